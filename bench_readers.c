@@ -0,0 +1,156 @@
+///<summary>
+/// Reader scaling benchmark. One writer thread keeps the ring topped up while
+/// 1, 2, 4 ... up to 64 reader threads (each with its own file descriptor)
+/// call read() as fast as they can. For every reader count it prints a CSV
+/// line with how many reads, messages and writes per second got through, so
+/// the effect of the driver's locking on concurrent readers is visible.
+///
+/// Usage: ./bench_readers [seconds per step] [max readers]
+///<summary>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>     // open()
+#include <unistd.h>    // read(), write(), close()
+#include <pthread.h>   // Threading
+#include <string.h>    // memset()
+#include <errno.h>
+#include <sched.h>     // sched_yield()
+#include <stdatomic.h> // stop flag shared with the threads
+#include <time.h>      // clock_gettime()
+#include "message.h"
+
+#define DEVICE_PATH "/dev/ipc_device"
+#define MESSAGE_TEXT_SIZE 64 // bytes of text in each benchmark message
+#define MAX_THREADS 64
+
+// Each thread counts into its own cache line so the benchmark itself
+// doesn't add the bouncing we're trying to measure
+struct counters {
+    unsigned long ops;  // read() or write() calls made
+    unsigned long msgs; // calls that actually moved a message
+    char pad[64 - 2 * sizeof(unsigned long)];
+};
+
+static atomic_int stop = 0;
+static struct counters reader_counts[MAX_THREADS];
+static struct counters writer_count;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void* bench_reader_thread(void* arg) {
+    struct counters *c = arg;
+    char buffer[4096];
+
+    // Non-blocking so an empty ring still counts as a trip through the lock
+    int fd = open(DEVICE_PATH, O_RDONLY | O_NONBLOCK);
+    if (fd == -1) {
+        perror("Failed to open device for reading");
+        return NULL;
+    }
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
+        c->ops++;
+        if (bytes_read > 0) {
+            c->msgs++;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+void* bench_writer_thread(void* arg) {
+    struct counters *c = arg;
+    char storage[sizeof(struct message_data) + MESSAGE_TEXT_SIZE];
+    struct message_data *msg = (struct message_data *)storage;
+
+    int fd = open(DEVICE_PATH, O_WRONLY);
+    if (fd == -1) {
+        perror("Failed to open device for writing");
+        return NULL;
+    }
+
+    memset(storage, 0, sizeof(storage));
+    msg->writer_pid = getpid();
+    msg->message_length = MESSAGE_TEXT_SIZE;
+    memset(msg->message, 'x', MESSAGE_TEXT_SIZE - 1);
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        msg->timestamp = time(NULL);
+        msg->unique_hash = c->ops;
+
+        ssize_t bytes_written = write(fd, storage, sizeof(storage));
+        c->ops++;
+        if (bytes_written > 0) {
+            c->msgs++;
+        } else if (errno == EAGAIN) {
+            sched_yield(); // ring is full, let the readers drain it
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+// Runs one step of the sweep with the given number of readers
+static void run_step(int readers, double seconds) {
+    pthread_t reader_tids[MAX_THREADS], writer_tid;
+
+    memset(reader_counts, 0, sizeof(reader_counts));
+    memset(&writer_count, 0, sizeof(writer_count));
+    atomic_store(&stop, 0);
+
+    pthread_create(&writer_tid, NULL, bench_writer_thread, &writer_count);
+    for (int i = 0; i < readers; i++) {
+        pthread_create(&reader_tids[i], NULL, bench_reader_thread, &reader_counts[i]);
+    }
+
+    double start = now_seconds();
+    usleep(seconds * 1e6);
+    atomic_store(&stop, 1);
+
+    for (int i = 0; i < readers; i++) {
+        pthread_join(reader_tids[i], NULL);
+    }
+    pthread_join(writer_tid, NULL);
+    double elapsed = now_seconds() - start;
+
+    unsigned long reads = 0, msgs = 0;
+    for (int i = 0; i < readers; i++) {
+        reads += reader_counts[i].ops;
+        msgs += reader_counts[i].msgs;
+    }
+
+    printf("%d,%.0f,%.0f,%.0f\n", readers, reads / elapsed, msgs / elapsed, writer_count.msgs / elapsed);
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    double seconds = 2.0;
+    int max_readers = MAX_THREADS;
+
+    if (argc > 1) {
+        seconds = atof(argv[1]);
+    }
+    if (argc > 2) {
+        max_readers = atoi(argv[2]);
+    }
+
+    if (seconds <= 0 || max_readers < 1 || max_readers > MAX_THREADS) {
+        printf("Expected format: %s [seconds per step] [max readers, 1-%d]\n", argv[0], MAX_THREADS);
+        return 1;
+    }
+
+    printf("readers,reads_per_sec,msgs_per_sec,writes_per_sec\n");
+    for (int readers = 1; readers <= max_readers; readers *= 2) {
+        run_step(readers, seconds);
+    }
+
+    return 0;
+}
@@ -1,4 +1,18 @@
-// Requires 'shared_mem' which it will read/encrypt
+// The legacy cipher: textbook RSA on one byte of the message at a time, with
+// a tiny modulus (61 * 53 = 3233 for the built in key).
+// A plaintext is a single byte and a ciphertext is below n, so instead of
+// running mod_exp() for every byte, both directions are worked out once per
+// key into lookup tables. Encrypting or decrypting a message is then one
+// table lookup per byte. Ciphertext is packed into one 16-bit word per byte,
+// instead of the 5 character "%05lld" decimal strings it used to be.
+//
+// Linked into ipc_driver.ko next to ipc_main.c, see the Makefile.
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/mm.h> // kvmalloc
+
+#include "crypto_lib.h"
 
 // Function that uses modular exponentiation to compute (base^exp) % mod
 // Basically, raises 'base' to the power of 'exp' under modulo 'mod' efficiently.
@@ -29,75 +43,70 @@ static long long mod_inverse(long long e, long long phi) {
     return (t < 0) ? t + phi : t; // Make sure result is positive
 }
 
-// Buffers to store encrypted and decrypted data separately
-static char encrypted_mem[SHM_SIZE] = {0}; // This holds encrypted data
-static char decrypted_mem[SHM_SIZE] = {0}; // This holds decrypted data
+// Builds the tables for the key made from primes p and q and public exponent e,
+// see crypto_lib.h
+int legacy_key_init(struct legacy_key *key, u32 p, u32 q, u32 e) {
+    u64 n = (u64)p * q;
+    u64 phi = (u64)(p - 1) * (q - 1);
+    u32 c;
+    int m;
 
-// Encrypt whatever is currently in shared memory
-static int encrypt_shared_memory(void) {
-    if (!shared_mem || data_written == 0) { // Check if there's anything to encrypt
-        printk(KERN_ERR "No data available in shared memory for encryption\n");
+    memset(key, 0, sizeof(*key));
+
+    if (p < 2 || q < 2 || n <= 255 || n > LEGACY_MAX_N || e < 2 || e >= phi) {
         return -EINVAL;
     }
 
-    // RSA Key Generation - hardcoded for now
-    long long p = 61, q = 53; 
-    long long n = p * q;
-    long long phi = (p - 1) * (q - 1);
-    long long e = 17; // Public exponent
-    long long d = mod_inverse(e, phi); // Private exponent
-
-    printk(KERN_INFO "Public Key: (e=%lld, n=%lld)\n", e, n);
-    printk(KERN_INFO "Private Key: (d=%lld, n=%lld)\n", d, n);
-
-    // Read message from shared memory
-    char message[256] = {0};
-    strncpy(message, shared_mem, sizeof(message) - 1);
-
-    printk(KERN_INFO "Original Message from Shared Memory: %s\n", message);
+    key->n = n;
+    key->e = e;
+    key->d = mod_inverse(e, phi);
+    if ((u64)key->e * key->d % phi != 1) { // e and phi have a common factor, no private exponent
+        return -EINVAL;
+    }
 
-    long long encrypted[256];
-    int len = strnlen(message, sizeof(message));
-    printk(KERN_INFO "Encrypted: ");
-    
-    memset(encrypted_mem, 0, sizeof(encrypted_mem)); // Clear before storing new encrypted data
+    key->dec = kvmalloc(n, GFP_KERNEL);
+    if (!key->dec) {
+        return -ENOMEM;
+    }
 
-    for (int i = 0; i < len; i++) {
-        encrypted[i] = mod_exp((long long)message[i], e, n); // Encrypt character
-        snprintf(&encrypted_mem[i * 5], 6, "%05lld", encrypted[i]); // Store encrypted as string
-        printk(KERN_CONT "%lld ", encrypted[i]);
+    for (m = 0; m < 256; m++) {
+        key->enc[m] = mod_exp(m, key->e, n);
+    }
+    for (c = 0; c < n; c++) {
+        key->dec[c] = mod_exp(c, key->d, n); // only the bytes' ciphertexts matter, the rest is never looked up
     }
-    printk(KERN_INFO "\n");
 
-    return 0; // Encryption done
+    // p or q not being prime shows up here
+    for (m = 0; m < 256; m++) {
+        if (key->dec[key->enc[m]] != m) {
+            kvfree(key->dec);
+            key->dec = NULL;
+            return -EINVAL;
+        }
+    }
+    return 0;
 }
 
-// Decrypt whatever is currently stored in encrypted_mem
-static int decrypt_shared_memory(void) {
-    if (strlen(encrypted_mem) == 0) { // Nothing to decrypt
-        printk(KERN_ERR "No encrypted data available to decrypt\n");
-        return -EINVAL;
-    }
+void legacy_key_free(struct legacy_key *key) {
+    kvfree(key->dec);
+    key->dec = NULL;
+}
 
-    // RSA Key Setup - same as above
-    long long p = 61, q = 53;
-    long long n = p * q;
-    long long phi = (p - 1) * (q - 1);
-    long long e = 17;
-    long long d = mod_inverse(e, phi);
+// Encrypts len bytes of in into len words of out
+void legacy_encrypt(const struct legacy_key *key, u16 *out, const u8 *in, size_t len) {
+    size_t i;
 
-    printk(KERN_INFO "Decrypting...\n");
+    for (i = 0; i < len; i++) {
+        out[i] = key->enc[in[i]];
+    }
+}
 
-    memset(decrypted_mem, 0, sizeof(decrypted_mem)); // Clear buffer before storing decrypted data
-    char temp[6] = {0}; // Temp buffer for extracting encrypted numbers
-    int len = strlen(encrypted_mem) / 5; // Each encrypted number is stored as 5 characters
+// Decrypts len words of in into len bytes of out
+// A word that can't be a ciphertext under this key comes out as 0
+void legacy_decrypt(const struct legacy_key *key, u8 *out, const u16 *in, size_t len) {
+    size_t i;
 
-    for (int i = 0; i < len; i++) {
-        strncpy(temp, &encrypted_mem[i * 5], 5); // Get one encrypted number
-        long long enc_val = simple_strtol(temp, NULL, 10); // Convert back to integer
-        decrypted_mem[i] = (char)mod_exp(enc_val, d, n); // Decrypt character
+    for (i = 0; i < len; i++) {
+        out[i] = in[i] < key->n ? key->dec[in[i]] : 0;
     }
-
-    printk(KERN_INFO "Decrypted Message: %s\n", decrypted_mem);
-    return 0; // Decryption done
 }
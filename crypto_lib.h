@@ -0,0 +1,30 @@
+// The legacy cipher: textbook RSA on one byte of the message at a time, with
+// a tiny modulus (61 * 53 = 3233 for the built in key). See crypto_lib.c.
+// Nothing in here touches the ring or takes locks, callers sort that out.
+#ifndef CRYPTO_LIB_H
+#define CRYPTO_LIB_H
+
+#include <linux/types.h>
+
+#define LEGACY_MAX_N 65536 // every ciphertext has to fit in a u16
+
+struct legacy_key {
+    u32 n, e, d;
+    u16 enc[256]; // enc[m] = m^e mod n
+    u8 *dec;      // dec[c] = c^d mod n, n entries
+};
+
+// Builds the tables for the key made from primes p and q and public exponent e
+// Returns -EINVAL if that isn't a key every byte survives a round trip through
+// (or its ciphertexts don't fit in 16 bits), -ENOMEM if the tables don't fit.
+int legacy_key_init(struct legacy_key *key, u32 p, u32 q, u32 e);
+void legacy_key_free(struct legacy_key *key);
+
+// Encrypts len bytes of in into len words of out
+void legacy_encrypt(const struct legacy_key *key, u16 *out, const u8 *in, size_t len);
+
+// Decrypts len words of in into len bytes of out
+// A word that can't be a ciphertext under this key comes out as 0
+void legacy_decrypt(const struct legacy_key *key, u8 *out, const u16 *in, size_t len);
+
+#endif
@@ -0,0 +1,499 @@
+///<summary>
+/// Throughput and latency benchmark for the device. Runs a number of writers
+/// and readers (threads, or processes with -P) against one channel for a few
+/// seconds per step, sweeping message sizes and ring sizes, and prints a CSV
+/// line per step: messages and MB per second, messages lost and duplicated,
+/// and end-to-end latency percentiles.
+///
+/// Every message carries a stamp after its struct message_data: which writer
+/// sent it, its sequence number for that writer and when it was sent
+/// (CLOCK_MONOTONIC, so it means the same thing in every process). Each
+/// reader checks the sequence numbers to count losses and duplicates and
+/// puts now - sent into a histogram.
+///
+/// Every reader sees every message, so "lost" is sent * readers minus what
+/// the readers got. Writers stop at the end of the step; readers keep going
+/// until they've had everything or nothing has come for a while.
+///
+/// With -U it runs against libipc's shared memory ring instead of the
+/// driver (ipc_client.h), to see what the kernel costs.
+///
+/// Usage: ./ipc_bench [-d device] [-w writers] [-r readers] [-t seconds]
+///                    [-s sizes] [-S ring sizes] [-P] [-U]
+///   sizes are comma separated message sizes in bytes, header included
+///   (default 64,256,1024,4096); ring sizes are IOCTL_SET_SHM_SIZE values
+///   (default: leave the ring alone, it's put back the way it was after)
+///<summary>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>    // fork(), usleep()
+#include <pthread.h>   // Threading
+#include <string.h>    // memset()
+#include <errno.h>
+#include <poll.h>      // POLLIN / POLLOUT for ipc_wait()
+#include <stdatomic.h> // flags and counters shared with the workers
+#include <time.h>      // clock_gettime()
+#include <stdint.h>
+#include <sys/mman.h>  // shared results for -P
+#include <sys/wait.h>  // waitpid()
+#include "message.h"
+#include "ipc_client.h" // the device or the shared memory ring, record framing, struct ipc_stats
+
+#define MAX_WRITERS 64
+#define MAX_READERS 64
+#define MAX_SWEEP 16      // sizes per list
+#define DRAIN_IDLE_MS 500 // readers give up once nothing has come for this long
+
+// Latency histogram, log-linear: 16 buckets per power of two of nanoseconds,
+// so any percentile is within ~6% of the real value
+#define LAT_SUB_BITS 4
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+
+// Goes at the start of the message text
+struct bench_stamp {
+    uint64_t sent_ns;
+    uint64_t seq;
+    uint32_t writer;
+    uint32_t pad;
+};
+
+// Each worker writes its own results, in their own cache lines
+struct writer_result {
+    _Alignas(64) unsigned long long sent;
+};
+
+struct reader_result {
+    _Alignas(64) unsigned long long received; // messages, duplicates included
+    unsigned long long duplicates;
+    unsigned long long latency[LAT_BUCKETS];
+};
+
+// Everything the workers share with main(), in a MAP_SHARED mapping so it
+// works the same for threads and for forked processes
+struct bench_shared {
+    atomic_int stop_writers;
+    atomic_int writers_done;        // set once the writers' counts are final
+    unsigned long long sent_total;  // valid once writers_done is set
+    struct writer_result writers[MAX_WRITERS];
+    struct reader_result readers[MAX_READERS];
+};
+
+// Settings for the current step
+struct bench_step {
+    int writers, readers;
+    size_t msg_size;
+    int shm_size;
+};
+
+static const char *device_path = IPC_DEFAULT_DEVICE;
+static enum ipc_backend backend = IPC_BACKEND_DEVICE; // -U for shared memory
+static struct bench_shared *shared;
+static struct bench_step step;
+static struct ipc_client *reader_clients[MAX_READERS];
+static int use_processes = 0; // -P
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int lat_bucket(uint64_t ns) {
+    if (ns < (1 << LAT_SUB_BITS)) {
+        return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) + ((ns >> (msb - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+// Smallest value that lands in bucket
+static uint64_t lat_bucket_value(int bucket) {
+    if (bucket < (1 << LAT_SUB_BITS)) {
+        return bucket;
+    }
+    int msb = (bucket >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    return (1ULL << msb) | ((uint64_t)(bucket & ((1 << LAT_SUB_BITS) - 1)) << (msb - LAT_SUB_BITS));
+}
+
+static double lat_percentile(const unsigned long long *hist, unsigned long long total, double pct) {
+    unsigned long long rank = total * pct / 100.0;
+    unsigned long long seen = 0;
+
+    if (total == 0) {
+        return 0;
+    }
+    if (rank >= total) {
+        rank = total - 1; // the 100th percentile is the largest
+    }
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank) {
+            return lat_bucket_value(i) / 1000.0; // microseconds
+        }
+    }
+    return 0;
+}
+
+void bench_writer(int id) {
+    struct writer_result *result = &shared->writers[id];
+    char *storage = calloc(1, step.msg_size);
+    struct message_data *msg = (struct message_data *)storage;
+    struct bench_stamp *stamp = (struct bench_stamp *)msg->message;
+
+    struct ipc_client *client = ipc_open(device_path, IPC_WRITE | IPC_NONBLOCK, backend);
+    if (!client || !storage) {
+        perror("Failed to open device for writing");
+        ipc_close(client);
+        free(storage);
+        return;
+    }
+
+    msg->writer_pid = getpid();
+    msg->message_length = step.msg_size - sizeof(struct message_data);
+    memset(stamp + 1, 'x', msg->message_length - sizeof(*stamp));
+    stamp->writer = id;
+
+    while (!atomic_load_explicit(&shared->stop_writers, memory_order_relaxed)) {
+        stamp->seq = result->sent;
+        stamp->sent_ns = now_ns();
+        msg->timestamp = stamp->sent_ns / 1000000000ULL;
+        msg->unique_hash = ((int64_t)id << 48) | result->sent; // never a duplicate, for the driver's dedup
+
+        ssize_t written = ipc_send(client, storage, step.msg_size);
+        if (written > 0) {
+            result->sent++;
+        } else if (written == -EAGAIN) {
+            ipc_wait(client, POLLOUT, 100); // ring is full, wait for the readers (but not past the stop flag)
+        } else {
+            fprintf(stderr, "Write failed: %s\n", strerror(-written));
+            break;
+        }
+    }
+
+    ipc_close(client);
+    free(storage);
+}
+
+void bench_reader(int id) {
+    struct reader_result *result = &shared->readers[id];
+    struct ipc_client *client = reader_clients[id];
+    unsigned long long next_seq[MAX_WRITERS] = { 0 };
+    unsigned long long unique = 0;
+    size_t buf_size = step.msg_size * 4 > 65536 ? step.msg_size * 4 : 65536;
+    char *batch = malloc(buf_size);
+
+    if (!batch) {
+        perror("Failed to allocate the read buffer");
+        return;
+    }
+
+    while (1) {
+        ssize_t bytes_read = ipc_recv_batch(client, batch, buf_size);
+
+        if (bytes_read <= 0) {
+            if (bytes_read < 0 && bytes_read != -EAGAIN && bytes_read != -EINTR) {
+                fprintf(stderr, "Read failed: %s\n", strerror(-bytes_read));
+                break;
+            }
+
+            // Nothing there. Once the writers are done, stop when we have it all or it's gone quiet
+            int done = atomic_load_explicit(&shared->writers_done, memory_order_acquire);
+            if (done && unique >= shared->sent_total) {
+                break;
+            }
+            if (ipc_wait(client, POLLIN, done ? DRAIN_IDLE_MS : 100) == 0 && done) {
+                break;
+            }
+            continue;
+        }
+
+        uint64_t now = now_ns();
+        ssize_t pos = 0;
+        while (pos + (ssize_t)sizeof(struct ipc_record_hdr) <= bytes_read) {
+            struct ipc_record_hdr *hdr = (struct ipc_record_hdr *)(batch + pos);
+            pos += RECORD_SIZE(hdr->len);
+            if (hdr->len < sizeof(struct message_data) + sizeof(struct bench_stamp)) {
+                continue; // someone else's message
+            }
+
+            struct bench_stamp *stamp = (struct bench_stamp *)((struct message_data *)(hdr + 1))->message;
+            if (stamp->writer >= MAX_WRITERS) {
+                continue;
+            }
+
+            result->received++;
+            if (stamp->seq < next_seq[stamp->writer]) {
+                result->duplicates++;
+                continue;
+            }
+            next_seq[stamp->writer] = stamp->seq + 1;
+            unique++;
+            result->latency[lat_bucket(now - stamp->sent_ns)]++;
+        }
+    }
+
+    free(batch);
+}
+
+struct thread_arg {
+    void (*fn)(int);
+    int id;
+};
+
+static void *thread_main(void *arg) {
+    struct thread_arg *t = arg;
+    t->fn(t->id);
+    return NULL;
+}
+
+struct workers {
+    int count;
+    pthread_t tids[MAX_WRITERS > MAX_READERS ? MAX_WRITERS : MAX_READERS];
+    pid_t pids[MAX_WRITERS > MAX_READERS ? MAX_WRITERS : MAX_READERS];
+    struct thread_arg args[MAX_WRITERS > MAX_READERS ? MAX_WRITERS : MAX_READERS];
+};
+
+// Starts fn(0) ... fn(count - 1) as threads, or as processes with -P
+static void start_workers(struct workers *w, void (*fn)(int), int count) {
+    w->count = count;
+    for (int i = 0; i < count; i++) {
+        if (use_processes) {
+            w->pids[i] = fork();
+            if (w->pids[i] == 0) {
+                fn(i);
+                _exit(0);
+            }
+            if (w->pids[i] == -1) {
+                perror("Failed to fork");
+            }
+        } else {
+            w->args[i].fn = fn;
+            w->args[i].id = i;
+            if (pthread_create(&w->tids[i], NULL, thread_main, &w->args[i]) != 0) {
+                perror("Failed to create thread");
+                w->count = i;
+                return;
+            }
+        }
+    }
+}
+
+static void join_workers(struct workers *w) {
+    for (int i = 0; i < w->count; i++) {
+        if (use_processes) {
+            if (w->pids[i] > 0) {
+                waitpid(w->pids[i], NULL, 0);
+            }
+        } else {
+            pthread_join(w->tids[i], NULL);
+        }
+    }
+}
+
+// Runs one step and prints its CSV line
+// control is open on the same channel, for the driver's stats
+static void run_step(struct ipc_client *control, double seconds) {
+    static unsigned long long latency[LAT_BUCKETS];
+    struct workers writers, readers;
+    struct ipc_stats before, after;
+    int stats_fd = ipc_fd(control); // -1 with shared memory, which has no stats
+
+    memset(shared, 0, sizeof(*shared));
+    memset(latency, 0, sizeof(latency));
+
+    // Readers open before anything is written, so they see every message
+    for (int i = 0; i < step.readers; i++) {
+        reader_clients[i] = ipc_open(device_path, IPC_READ | IPC_NONBLOCK, backend);
+        if (!reader_clients[i]) {
+            perror("Failed to open device for reading");
+            for (int j = 0; j < i; j++) {
+                ipc_close(reader_clients[j]);
+            }
+            return;
+        }
+    }
+
+    memset(&before, 0, sizeof(before));
+    memset(&after, 0, sizeof(after));
+    if (stats_fd != -1) {
+        ioctl(stats_fd, IOCTL_GET_STATS, &before);
+    }
+
+    uint64_t start = now_ns();
+    start_workers(&readers, bench_reader, step.readers);
+    start_workers(&writers, bench_writer, step.writers);
+
+    usleep(seconds * 1e6);
+    atomic_store(&shared->stop_writers, 1);
+    join_workers(&writers);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    unsigned long long sent = 0;
+    for (int i = 0; i < step.writers; i++) {
+        sent += shared->writers[i].sent;
+    }
+    shared->sent_total = sent;
+    atomic_store_explicit(&shared->writers_done, 1, memory_order_release);
+    join_workers(&readers);
+
+    if (stats_fd != -1) {
+        ioctl(stats_fd, IOCTL_GET_STATS, &after);
+    }
+    for (int i = 0; i < step.readers; i++) {
+        ipc_close(reader_clients[i]);
+    }
+
+    unsigned long long received = 0, duplicates = 0, unique = 0;
+    for (int i = 0; i < step.readers; i++) {
+        received += shared->readers[i].received;
+        duplicates += shared->readers[i].duplicates;
+        for (int b = 0; b < LAT_BUCKETS; b++) {
+            latency[b] += shared->readers[i].latency[b];
+        }
+    }
+    unique = received - duplicates;
+    unsigned long long expected = sent * step.readers;
+
+    printf("%s,%s,%d,%d,%zu,%d,%.2f,%llu,%.0f,%.2f,%llu,%llu,%llu,%llu,%.1f,%.1f,%.1f,%.1f\n",
+           backend == IPC_BACKEND_SHM ? "shm" : "device", use_processes ? "processes" : "threads", step.writers, step.readers, step.msg_size, step.shm_size,
+           elapsed, sent, sent / elapsed, sent * step.msg_size / elapsed / (1024 * 1024),
+           received, expected > unique ? expected - unique : 0, duplicates,
+           (unsigned long long)(after.duplicates - before.duplicates),
+           lat_percentile(latency, unique, 50), lat_percentile(latency, unique, 99),
+           lat_percentile(latency, unique, 99.9), lat_percentile(latency, unique, 100));
+    fflush(stdout);
+}
+
+// "64,256,1024" -> list, returns how many or -1
+static int parse_list(const char *text, long *list) {
+    int count = 0;
+    char *end;
+
+    while (*text) {
+        if (count == MAX_SWEEP) {
+            return -1;
+        }
+        list[count] = strtol(text, &end, 10);
+        if (end == text || list[count] <= 0 || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        count++;
+        text = *end ? end + 1 : end;
+    }
+    return count;
+}
+
+int main(int argc, char* argv[]) {
+    const char *program = argv[0];
+    double seconds = 2.0;
+    long sizes[MAX_SWEEP] = { 64, 256, 1024, 4096 };
+    long shm_sizes[MAX_SWEEP];
+    int size_count = 4, shm_count = 0;
+    int bad_args = 0;
+    int original_shm, current_shm;
+
+    step.writers = 1;
+    step.readers = 1;
+
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-P") == 0) {
+            use_processes = 1;
+            argv++;
+            argc--;
+            continue;
+        }
+        if (strcmp(argv[1], "-U") == 0) {
+            backend = IPC_BACKEND_SHM;
+            argv++;
+            argc--;
+            continue;
+        }
+
+        if (argc > 2 && strcmp(argv[1], "-d") == 0) {
+            device_path = argv[2];
+        } else if (argc > 2 && strcmp(argv[1], "-w") == 0) {
+            step.writers = atoi(argv[2]);
+        } else if (argc > 2 && strcmp(argv[1], "-r") == 0) {
+            step.readers = atoi(argv[2]);
+        } else if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+            seconds = atof(argv[2]);
+        } else if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+            size_count = parse_list(argv[2], sizes);
+            bad_args |= size_count == -1;
+        } else if (argc > 2 && strcmp(argv[1], "-S") == 0) {
+            shm_count = parse_list(argv[2], shm_sizes);
+            bad_args |= shm_count == -1;
+        } else {
+            bad_args = 1; // unknown option
+            break;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (bad_args || argc > 1 || seconds <= 0 || step.writers < 1 || step.writers > MAX_WRITERS ||
+        step.readers < 0 || step.readers > MAX_READERS) {
+        printf("Expected format: %s [-d device] [-w writers, 1-%d] [-r readers, 0-%d] [-t seconds per step]\n"
+               "                 [-s message sizes,...] [-S ring sizes,...] [-P] [-U]\n", program, MAX_WRITERS, MAX_READERS);
+        return 1;
+    }
+
+    struct ipc_client *control = ipc_open(device_path, IPC_WRITE, backend);
+    if (!control) {
+        perror("Failed to open device");
+        return 1;
+    }
+    original_shm = ipc_ring_size(control);
+    if (shm_count == 0) {
+        shm_sizes[shm_count++] = original_shm;
+    }
+    current_shm = original_shm;
+
+    // Shared with the workers, whether they're threads or processes
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("Failed to map the results");
+        return 1;
+    }
+
+    printf("backend,mode,writers,readers,msg_size,shm_size,seconds,sent,msgs_per_sec,mb_per_sec,"
+           "received,lost,duplicates,driver_dropped,p50_us,p99_us,p999_us,max_us\n");
+
+    for (int s = 0; s < shm_count; s++) {
+        int shm_size = shm_sizes[s];
+
+        if (shm_size != current_shm) {
+            int err = ipc_set_ring_size(control, shm_size);
+            if (err) {
+                fprintf(stderr, "Skipping ring size %d: %s\n", shm_size, strerror(-err));
+                continue;
+            }
+            current_shm = shm_size;
+        }
+        step.shm_size = current_shm;
+
+        for (int i = 0; i < size_count; i++) {
+            step.msg_size = sizes[i];
+            if (step.msg_size < sizeof(struct message_data) + sizeof(struct bench_stamp)) {
+                fprintf(stderr, "Skipping %zu byte messages: the header and stamp need %zu\n",
+                        step.msg_size, sizeof(struct message_data) + sizeof(struct bench_stamp));
+                continue;
+            }
+            if (RECORD_SIZE(step.msg_size) > (size_t)step.shm_size) {
+                fprintf(stderr, "Skipping %zu byte messages: bigger than the %d byte ring\n", step.msg_size, step.shm_size);
+                continue;
+            }
+            run_step(control, seconds);
+        }
+    }
+
+    // Put the ring back how we found it
+    if (current_shm != original_shm && ipc_set_ring_size(control, original_shm) != 0) {
+        fprintf(stderr, "Failed to restore the ring size\n");
+    }
+
+    munmap(shared, sizeof(*shared));
+    ipc_close(control);
+    return 0;
+}
@@ -0,0 +1,709 @@
+///<summary> libipc, see ipc_client.h. One struct ipc_client per open channel,
+/// every call goes to the device or to the shared memory ring depending on which backend it got.
+///<summary>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>    // open()
+#include <unistd.h>   // read(), write(), close()
+#include <string.h>
+#include <errno.h>
+#include <limits.h>   // INT_MAX
+#include <poll.h>
+#include <signal.h>   // kill() to see if a reader is still around
+#include <pthread.h>  // the shared ring's writer lock
+#include <stdatomic.h>
+#include <sys/mman.h> // shm_open(), mmap()
+#include <sys/stat.h>
+#include <sys/file.h> // flock() on the shm object while it's being set up
+#include <sys/syscall.h>
+#include <linux/futex.h> // sleeping on the shared ring
+#include "ipc_client.h"
+
+// The shared memory ring is laid out like the device's mapping: the control
+// page, then the data. Its control page also has this, after the ipc_ring_ctrl
+#define IPC_SHM_MAGIC 0x49504332 // "IPC2", set once the ring is ready
+#define IPC_SHM_SYNC_OFFSET ((sizeof(struct ipc_ring_ctrl) + 63) & ~(size_t)63)
+
+struct ipc_shm_sync {
+    atomic_uint magic;
+    atomic_uint pushed;          // futex, bumped after every push, readers sleep on it
+    atomic_uint popped;          // futex, bumped after every pop, writers sleep on it
+    atomic_uint readers_waiting; // so nobody calls FUTEX_WAKE for nothing
+    atomic_uint writers_waiting;
+    pthread_mutex_t lock;        // one writer at a time (ipc_ring_push is single producer), and slot changes
+    pid_t owners[IPC_RING_MAX_READERS]; // process holding each reader slot
+};
+
+_Static_assert(IPC_SHM_SYNC_OFFSET + sizeof(struct ipc_shm_sync) <= 4096, "shm sync doesn't fit in the control page");
+
+struct ipc_client {
+    enum ipc_backend backend;
+    int flags;
+
+    // Device
+    int fd;
+    int read_mode; // what IOCTL_SET_READ_MODE was last set to
+
+    // Shared memory
+    struct ipc_ring_ctrl *ring;
+    struct ipc_shm_sync *sync;
+    size_t map_size;
+    int slot; // reader cursor slot, -1 if not reading
+};
+
+static int futex_wait(atomic_uint *addr, unsigned val, int timeout_ms) {
+    struct timespec ts, *timeout = NULL;
+
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        timeout = &ts;
+    }
+    // Not FUTEX_PRIVATE, the other side is in another process
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// A writer that died holding the lock can't have left the ring half updated
+// (head is published last), so just carry on
+static void shm_lock(struct ipc_client *client) {
+    if (pthread_mutex_lock(&client->sync->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&client->sync->lock);
+    }
+}
+
+static void shm_unlock(struct ipc_client *client) {
+    pthread_mutex_unlock(&client->sync->lock);
+}
+
+// /dev/ipc_device1 -> /ipc_device1
+static void shm_name(const char *device, char *name, size_t len) {
+    const char *base = strrchr(device, '/');
+    snprintf(name, len, "/%s", base ? base + 1 : device);
+}
+
+// Sets up a ring in the shm object we just created
+// The creator holds an flock() on the object until the ring is ready, so
+// anyone opening it in the meantime waits for that, see shm_join().
+static int shm_create(struct ipc_client *client, int fd, const char *name) {
+    pthread_mutexattr_t attr;
+
+    if (flock(fd, LOCK_EX) == -1) { // let go of when fd is closed, or if we die
+        int err = -errno;
+        shm_unlink(name);
+        return err;
+    }
+
+    client->map_size = ipc_ring_map_size(IPC_SHM_RING_SIZE);
+    if (ftruncate(fd, client->map_size) == -1) {
+        int err = -errno;
+        shm_unlink(name);
+        return err;
+    }
+
+    client->ring = mmap(NULL, client->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (client->ring == MAP_FAILED) {
+        int err = -errno;
+        client->ring = NULL;
+        shm_unlink(name);
+        return err;
+    }
+    client->sync = (struct ipc_shm_sync *)((char *)client->ring + IPC_SHM_SYNC_OFFSET);
+
+    client->ring->size = IPC_SHM_RING_SIZE;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&client->sync->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    atomic_store_explicit(&client->sync->magic, IPC_SHM_MAGIC, memory_order_release);
+
+    flock(fd, LOCK_UN);
+    return 0;
+}
+
+// Maps a ring somebody else created
+// Returns -ESTALE if it still isn't ready once nobody holds its lock any more,
+// which means its creator died before it got there.
+static int shm_join(struct ipc_client *client, int fd) {
+    struct stat st;
+
+    // The creator may not have taken the lock yet, give it a moment
+    for (int tries = 0; tries < 1000; tries++) {
+        if (flock(fd, LOCK_SH) == -1) { // waits while the creator is setting it up
+            return -errno;
+        }
+        if (fstat(fd, &st) == -1) {
+            return -errno;
+        }
+
+        if (st.st_size > 0) {
+            client->ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (client->ring == MAP_FAILED) {
+                client->ring = NULL;
+                return -errno;
+            }
+            client->sync = (struct ipc_shm_sync *)((char *)client->ring + IPC_SHM_SYNC_OFFSET);
+            if (atomic_load_explicit(&client->sync->magic, memory_order_acquire) == IPC_SHM_MAGIC) {
+                client->map_size = st.st_size;
+                flock(fd, LOCK_UN);
+                return 0;
+            }
+            munmap(client->ring, st.st_size);
+            client->ring = NULL;
+        }
+
+        flock(fd, LOCK_UN);
+        usleep(1000);
+    }
+    return -ESTALE;
+}
+
+// Opens the shared ring for this device, creating it if nobody has yet
+// A ring left half built by a creator that died is removed and made again.
+static int shm_attach(struct ipc_client *client, const char *device) {
+    char name[256];
+    int err = -ESTALE;
+
+    shm_name(device, name, sizeof(name));
+
+    for (int attempt = 0; attempt < 3 && (err == -ESTALE || err == -ENOENT); attempt++) {
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600); // only this user's processes can join
+
+        if (fd != -1) {
+            err = shm_create(client, fd, name);
+            close(fd);
+            continue;
+        }
+        if (errno != EEXIST) {
+            return -errno;
+        }
+
+        fd = shm_open(name, O_RDWR, 0);
+        if (fd == -1) {
+            err = -errno; // ENOENT: removed since, try creating it again
+            continue;
+        }
+
+        err = shm_join(client, fd);
+        if (err == -ESTALE) {
+            // Remove it, unless the name has already been given to a new
+            // ring by somebody else who found it stale
+            struct stat stale, now;
+            int cur = shm_open(name, O_RDWR, 0);
+
+            if (cur != -1 && fstat(fd, &stale) == 0 && fstat(cur, &now) == 0 && stale.st_ino == now.st_ino) {
+                shm_unlink(name);
+            }
+            if (cur != -1) {
+                close(cur);
+            }
+        }
+        close(fd);
+    }
+    if (err) {
+        return err == -ESTALE ? -ETIMEDOUT : err;
+    }
+
+    // Readers get a cursor slot, starting at the newest message like the device's readers
+    if (client->flags & IPC_READ) {
+        shm_lock(client);
+        for (int slot = 0; slot < IPC_RING_MAX_READERS; slot++) {
+            if (!(client->ring->readers[slot / 64] & (1ULL << (slot % 64)))) {
+                client->ring->cursors[slot] = client->ring->head;
+                client->sync->owners[slot] = getpid();
+                __atomic_fetch_or(&client->ring->readers[slot / 64], 1ULL << (slot % 64), __ATOMIC_RELEASE);
+                client->slot = slot;
+                break;
+            }
+        }
+        shm_unlock(client);
+
+        if (client->slot == -1) {
+            munmap(client->ring, client->map_size);
+            client->ring = NULL;
+            return -EBUSY;
+        }
+    }
+    return 0;
+}
+
+static int device_attach(struct ipc_client *client, const char *device) {
+    int mode = O_WRONLY;
+
+    if ((client->flags & IPC_READ) && (client->flags & IPC_WRITE)) {
+        mode = O_RDWR;
+    } else if (client->flags & IPC_READ) {
+        mode = O_RDONLY;
+    }
+    if (client->flags & IPC_NONBLOCK) {
+        mode |= O_NONBLOCK;
+    }
+
+    client->fd = open(device, mode);
+    return client->fd == -1 ? -errno : 0;
+}
+
+struct ipc_client *ipc_open(const char *device, int flags, enum ipc_backend backend) {
+    struct ipc_client *client = calloc(1, sizeof(*client));
+    int err = -EINVAL;
+
+    if (!client) {
+        return NULL;
+    }
+    client->flags = flags;
+    client->fd = -1;
+    client->slot = -1;
+    client->read_mode = IPC_READ_SINGLE;
+
+    if (backend != IPC_BACKEND_SHM) {
+        err = device_attach(client, device);
+        client->backend = IPC_BACKEND_DEVICE;
+    }
+
+    // Fall back to shared memory only if the module isn't there, not for e.g. EACCES
+    if (backend == IPC_BACKEND_SHM ||
+        (backend == IPC_BACKEND_AUTO && (err == -ENOENT || err == -ENODEV || err == -ENXIO))) {
+        err = shm_attach(client, device);
+        client->backend = IPC_BACKEND_SHM;
+    }
+
+    if (err) {
+        free(client);
+        errno = -err;
+        return NULL;
+    }
+    return client;
+}
+
+void ipc_close(struct ipc_client *client) {
+    if (!client) {
+        return;
+    }
+
+    if (client->backend == IPC_BACKEND_DEVICE) {
+        close(client->fd);
+    } else {
+        if (client->slot != -1) {
+            shm_lock(client);
+            __atomic_fetch_and(&client->ring->readers[client->slot / 64], ~(1ULL << (client->slot % 64)), __ATOMIC_RELEASE);
+            client->sync->owners[client->slot] = 0;
+            shm_unlock(client);
+
+            // Writers waiting on us can move on now
+            atomic_fetch_add(&client->sync->popped, 1);
+            if (atomic_load(&client->sync->writers_waiting)) {
+                futex_wake(&client->sync->popped);
+            }
+        }
+        munmap(client->ring, client->map_size);
+    }
+    free(client);
+}
+
+enum ipc_backend ipc_backend(struct ipc_client *client) {
+    return client->backend;
+}
+
+int ipc_fd(struct ipc_client *client) {
+    return client->backend == IPC_BACKEND_DEVICE ? client->fd : -1;
+}
+
+// A reader that died without ipc_close() would hold on to its messages
+// forever, the device gets this for free when the process's files are closed.
+// Gives back the slots of readers that aren't around any more.
+// Caller holds the lock. Returns whether it found any.
+static int shm_reap_readers(struct ipc_client *client) {
+    int reaped = 0;
+
+    for (int slot = 0; slot < IPC_RING_MAX_READERS; slot++) {
+        pid_t owner = client->sync->owners[slot];
+
+        if (!(client->ring->readers[slot / 64] & (1ULL << (slot % 64))) || owner <= 0) {
+            continue;
+        }
+        if (kill(owner, 0) == -1 && errno == ESRCH) {
+            __atomic_fetch_and(&client->ring->readers[slot / 64], ~(1ULL << (slot % 64)), __ATOMIC_RELEASE);
+            client->sync->owners[slot] = 0;
+            reaped = 1;
+        }
+    }
+    return reaped;
+}
+
+// Pushes entries[0..count) into the shared ring under one lock and one
+// wakeup, stopping at the first one that doesn't fit. Returns how many were dealt with.
+static unsigned shm_push_batch(struct ipc_client *client, struct ipc_batch_entry *entries, unsigned count) {
+    unsigned done = 0;
+
+    shm_lock(client);
+    while (done < count) {
+        int err = 0;
+
+        if (entries[done].len > 0) { // like write(), an empty message isn't queued
+            err = ipc_ring_push(client->ring, (void *)(uintptr_t)entries[done].data, entries[done].len);
+            if (err == -EAGAIN && shm_reap_readers(client)) {
+                err = ipc_ring_push(client->ring, (void *)(uintptr_t)entries[done].data, entries[done].len);
+            }
+        }
+        if (err == -EAGAIN) {
+            break;
+        }
+        entries[done].status = err ? err : (int)entries[done].len;
+        done++;
+    }
+    shm_unlock(client);
+
+    if (done > 0) {
+        atomic_fetch_add(&client->sync->pushed, 1);
+        if (atomic_load(&client->sync->readers_waiting)) {
+            futex_wake(&client->sync->pushed);
+        }
+    }
+    return done;
+}
+
+long ipc_send_batch(struct ipc_client *client, struct ipc_batch_entry *entries, unsigned count) {
+    unsigned done = 0;
+    long written = 0;
+
+    while (done < count) {
+        unsigned dealt;
+
+        if (client->backend == IPC_BACKEND_SHM) {
+            unsigned seen = atomic_load(&client->sync->popped); // before looking, so no wakeup is missed
+            dealt = shm_push_batch(client, entries + done, count - done);
+            if (done + dealt < count && !(client->flags & IPC_NONBLOCK)) {
+                atomic_fetch_add(&client->sync->writers_waiting, 1);
+                futex_wait(&client->sync->popped, seen, 1000);
+                atomic_fetch_sub(&client->sync->writers_waiting, 1);
+            }
+        } else {
+            unsigned chunk = count - done < IPC_BATCH_MAX ? count - done : IPC_BATCH_MAX;
+            struct ipc_batch batch = {
+                .entries = (uintptr_t)(entries + done),
+                .count = chunk,
+            };
+
+            if (ioctl(client->fd, IOCTL_WRITE_BATCH, &batch) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return written > 0 ? written : -errno;
+            }
+
+            // The driver fails everything after the first message that
+            // didn't fit with -EAGAIN too, start again from there
+            dealt = 0;
+            while (dealt < chunk && entries[done + dealt].status != -EAGAIN) {
+                dealt++;
+            }
+            if (dealt < chunk && !(client->flags & IPC_NONBLOCK)) {
+                struct pollfd pfd = { .fd = client->fd, .events = POLLOUT };
+                poll(&pfd, 1, 1000); // the timeout only matters if a wakeup got lost
+            }
+        }
+
+        for (unsigned i = done; i < done + dealt; i++) {
+            if (entries[i].status >= 0) {
+                written++;
+            }
+        }
+        done += dealt;
+
+        if (done < count && (client->flags & IPC_NONBLOCK)) {
+            for (unsigned i = done; i < count; i++) {
+                entries[i].status = -EAGAIN;
+            }
+            break;
+        }
+    }
+    return written;
+}
+
+ssize_t ipc_send(struct ipc_client *client, const void *msg, size_t len) {
+    if (len > UINT32_MAX) { // records store their length in 32 bits
+        return -EMSGSIZE;
+    }
+
+    if (client->backend == IPC_BACKEND_DEVICE) {
+        for (;;) {
+            ssize_t written = write(client->fd, msg, len);
+            if (written != -1) {
+                return written;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN || (client->flags & IPC_NONBLOCK)) {
+                return -errno;
+            }
+
+            // Full, the driver says so even without O_NONBLOCK
+            struct pollfd pfd = { .fd = client->fd, .events = POLLOUT };
+            poll(&pfd, 1, 1000); // the timeout only matters if a wakeup got lost
+        }
+    }
+
+    struct ipc_batch_entry entry = { .data = (uintptr_t)msg, .len = len };
+    long written = ipc_send_batch(client, &entry, 1);
+    if (written < 0) {
+        return written;
+    }
+    return entry.status;
+}
+
+static int device_read_mode(struct ipc_client *client, int mode) {
+    if (client->read_mode != mode) {
+        if (ioctl(client->fd, IOCTL_SET_READ_MODE, &mode) == -1) {
+            return -errno;
+        }
+        client->read_mode = mode;
+    }
+    return 0;
+}
+
+// Copies records out of the shared ring into buf, framed if 'framed' or
+// just the first payload if not. Returns bytes copied, 0 if there's nothing new.
+static ssize_t shm_pop(struct ipc_client *client, char *buf, size_t len, int framed) {
+    struct ipc_ring_ctrl *ring = client->ring;
+    __u64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE); // records before this are complete
+    __u64 cursor = ring->cursors[client->slot];
+    size_t used = 0;
+
+    while (cursor != head) {
+        struct ipc_record_hdr hdr;
+
+        ipc_ring_copy_out(ring, &hdr, cursor, sizeof(hdr));
+        if (!framed) {
+            if (hdr.len > len) {
+                return -EMSGSIZE;
+            }
+            ipc_ring_copy_out(ring, buf, cursor + sizeof(hdr), hdr.len);
+            used = hdr.len;
+            cursor += RECORD_SIZE(hdr.len);
+            break;
+        }
+
+        if (used + RECORD_SIZE(hdr.len) > len) {
+            if (used == 0) {
+                return -EMSGSIZE;
+            }
+            break;
+        }
+        ipc_ring_copy_out(ring, buf + used, cursor, RECORD_SIZE(hdr.len));
+        used += RECORD_SIZE(hdr.len);
+        cursor += RECORD_SIZE(hdr.len);
+    }
+
+    if (cursor != ring->cursors[client->slot]) {
+        __atomic_store_n(&ring->cursors[client->slot], cursor, __ATOMIC_RELEASE); // done with them
+        atomic_fetch_add(&client->sync->popped, 1);
+        if (atomic_load(&client->sync->writers_waiting)) {
+            futex_wake(&client->sync->popped);
+        }
+    }
+    return used;
+}
+
+static ssize_t recv_common(struct ipc_client *client, void *buf, size_t len, int framed) {
+    if (client->backend == IPC_BACKEND_DEVICE) {
+        int err = device_read_mode(client, framed ? IPC_READ_FRAMED : IPC_READ_SINGLE);
+        if (err) {
+            return err;
+        }
+        ssize_t bytes_read = read(client->fd, buf, len);
+        return bytes_read == -1 ? -errno : bytes_read;
+    }
+
+    if (client->slot == -1) {
+        return -EBADF; // not opened with IPC_READ
+    }
+
+    while (1) {
+        unsigned seen = atomic_load(&client->sync->pushed); // before looking, so no wakeup is missed
+        ssize_t got = shm_pop(client, buf, len, framed);
+
+        if (got != 0) {
+            return got; // messages, or an error
+        }
+        if (client->flags & IPC_NONBLOCK) {
+            return -EAGAIN;
+        }
+
+        atomic_fetch_add(&client->sync->readers_waiting, 1);
+        futex_wait(&client->sync->pushed, seen, -1);
+        atomic_fetch_sub(&client->sync->readers_waiting, 1);
+    }
+}
+
+ssize_t ipc_recv(struct ipc_client *client, void *buf, size_t len) {
+    return recv_common(client, buf, len, 0);
+}
+
+ssize_t ipc_recv_batch(struct ipc_client *client, void *buf, size_t len) {
+    return recv_common(client, buf, len, 1);
+}
+
+// Shared memory can only sleep on one futex, so with both events asked for
+// it waits for a message and reports room as it finds it
+int ipc_wait(struct ipc_client *client, short events, int timeout_ms) {
+    if (client->backend == IPC_BACKEND_DEVICE) {
+        struct pollfd pfd = { .fd = client->fd, .events = events };
+        int ret = poll(&pfd, 1, timeout_ms);
+        if (ret == -1) {
+            return -errno;
+        }
+        return ret ? pfd.revents : 0;
+    }
+
+    struct ipc_ring_ctrl *ring = client->ring;
+    int sleeps = 0;
+
+    while (1) {
+        unsigned pushed = atomic_load(&client->sync->pushed);
+        unsigned popped = atomic_load(&client->sync->popped);
+        int ready = 0;
+
+        if ((events & POLLIN) && client->slot != -1 &&
+            ring->cursors[client->slot] != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            ready |= POLLIN;
+        }
+        if (events & POLLOUT) {
+            shm_lock(client);
+            if (ring->head - ipc_ring_slowest_reader(ring) < ring->size) { // what the next push could free
+                ready |= POLLOUT;
+            }
+            shm_unlock(client);
+        }
+        if (ready || timeout_ms == 0 || sleeps++ > 0) {
+            return ready;
+        }
+
+        if (events & POLLIN) {
+            atomic_fetch_add(&client->sync->readers_waiting, 1);
+            futex_wait(&client->sync->pushed, pushed, timeout_ms);
+            atomic_fetch_sub(&client->sync->readers_waiting, 1);
+        } else {
+            atomic_fetch_add(&client->sync->writers_waiting, 1);
+            futex_wait(&client->sync->popped, popped, timeout_ms);
+            atomic_fetch_sub(&client->sync->writers_waiting, 1);
+        }
+    }
+}
+
+// The shared ring is walked from the tail the same way the driver does it
+static int shm_seek(struct ipc_client *client, uint64_t *seq) {
+    struct ipc_ring_ctrl *ring = client->ring;
+    struct ipc_record_hdr hdr;
+    int err = 0;
+
+    shm_lock(client);
+    __u64 head = ring->head;
+    __u64 pos = ring->tail;
+
+    if (head - pos > ring->size) {
+        err = -EIO;
+    }
+    for (; !err && pos != head; pos += RECORD_SIZE(hdr.len)) {
+        ipc_ring_copy_out(ring, &hdr, pos, sizeof(hdr));
+        if (RECORD_SIZE(hdr.len) > head - pos) {
+            err = -EIO;
+        } else if (hdr.seq >= *seq) {
+            break;
+        }
+    }
+    if (!err) {
+        *seq = pos != head ? hdr.seq : ring->seq;
+        __atomic_store_n(&ring->cursors[client->slot], pos, __ATOMIC_RELEASE);
+    }
+    shm_unlock(client);
+
+    // Moving forward frees space
+    atomic_fetch_add(&client->sync->popped, 1);
+    if (atomic_load(&client->sync->writers_waiting)) {
+        futex_wake(&client->sync->popped);
+    }
+    return err;
+}
+
+int ipc_seek(struct ipc_client *client, uint64_t *seq) {
+    if (client->backend == IPC_BACKEND_SHM) {
+        if (client->slot == -1) {
+            return -EBADF; // not opened with IPC_READ
+        }
+        return shm_seek(client, seq);
+    }
+
+    __u64 value = *seq;
+    if (ioctl(client->fd, IOCTL_SEEK_SEQ, &value) == -1) {
+        return -errno;
+    }
+    *seq = value;
+    return 0;
+}
+
+int ipc_set_retention(struct ipc_client *client, uint32_t messages, uint32_t bytes) {
+    struct ipc_retention retention = { .messages = messages, .bytes = bytes };
+
+    if (client->backend == IPC_BACKEND_SHM) {
+        shm_lock(client);
+        client->ring->retain_messages = messages;
+        client->ring->retain_bytes = bytes;
+        shm_unlock(client);
+        return 0;
+    }
+    if (ioctl(client->fd, IOCTL_SET_RETENTION, &retention) == -1) {
+        return -errno;
+    }
+    return 0;
+}
+
+int ipc_ring_size(struct ipc_client *client) {
+    int size;
+
+    if (client->backend == IPC_BACKEND_SHM) {
+        return client->ring->size;
+    }
+    if (ioctl(client->fd, IOCTL_GET_SHM_SIZE, &size) == -1) {
+        return -errno;
+    }
+    return size;
+}
+
+int ipc_set_ring_size(struct ipc_client *client, int size) {
+    if (client->backend == IPC_BACKEND_SHM) {
+        return -EOPNOTSUPP; // fixed when it's created
+    }
+    // EBUSY while someone has the ring mapped, ENOSPC if the queued messages wouldn't fit
+    if (ioctl(client->fd, IOCTL_SET_SHM_SIZE, &size) == -1) {
+        return -errno;
+    }
+    return 0;
+}
+
+size_t ipc_message_build(void *buf, size_t buf_len, pid_t pid, time_t timestamp,
+                         const void *text, size_t text_len) {
+    struct message_data *msg = buf;
+    char number[32];
+    int64_t hash = IPC_HASH_INIT;
+
+    if (buf_len < IPC_MESSAGE_SIZE(text_len)) {
+        return 0;
+    }
+
+    msg->writer_pid = pid; // Process ID of the writer
+    msg->timestamp = timestamp; // When the message was created
+    msg->message_length = text_len; // Length of the actual message's content
+    memcpy(msg->message, text, text_len);
+
+    hash = ipc_hash_update(hash, number, sprintf(number, "%ld", (long)timestamp));
+    hash = ipc_hash_update(hash, number, sprintf(number, "%ld", (long)pid));
+    msg->unique_hash = ipc_hash_update(hash, msg->message, text_len); // Used for identifying unique messages
+
+    return IPC_MESSAGE_SIZE(text_len);
+}
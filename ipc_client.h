@@ -0,0 +1,135 @@
+// libipc: what user programs need to talk to a channel, whichever way it's
+// carried. Link with libipc.a (make libipc.a).
+//
+// A channel is named by its device path, /dev/ipc_device or /dev/ipc_deviceN.
+// There are two backends behind the same calls:
+//
+//   IPC_BACKEND_DEVICE  the kernel module: read(), write() and the ioctls
+//   IPC_BACKEND_SHM     a ring in POSIX shared memory (shm_open), for when the
+//                       module isn't loaded, or to compare against it. Same
+//                       ring layout as the device's mmap (ipc_ring.h), with a
+//                       process-shared lock for writers and futexes to sleep on.
+//                       The shm object is named after the device, /ipc_deviceN,
+//                       and created by whoever opens it first, with mode 0600
+//                       so only that user's processes can open it after. If
+//                       the creator dies before the ring is set up, the next
+//                       ipc_open() makes it again. No encryption, dedup or
+//                       stats, those are the driver's.
+//
+// IPC_BACKEND_AUTO uses the device if it's there and shared memory if not.
+//
+// ipc_open() returns NULL and sets errno on failure, every other call returns
+// -errno. Without IPC_NONBLOCK, sending waits for room and receiving waits for
+// a message.
+#ifndef IPC_CLIENT_H
+#define IPC_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include "message.h"
+#include "ipc_ring.h"
+
+#define IPC_DEFAULT_DEVICE "/dev/ipc_device"
+#define IPC_SHM_RING_SIZE (1 << 20) // data bytes in a shared memory ring
+
+enum ipc_backend {
+    IPC_BACKEND_AUTO,
+    IPC_BACKEND_DEVICE,
+    IPC_BACKEND_SHM,
+};
+
+// ipc_open() flags
+#define IPC_READ 1     // gets a reader cursor, sees every message sent after this
+#define IPC_WRITE 2
+#define IPC_NONBLOCK 4 // -EAGAIN instead of waiting
+
+struct ipc_client;
+
+struct ipc_client *ipc_open(const char *device, int flags, enum ipc_backend backend);
+void ipc_close(struct ipc_client *client);
+
+enum ipc_backend ipc_backend(struct ipc_client *client); // the one it ended up with
+int ipc_fd(struct ipc_client *client); // the device's file descriptor, -1 for shared memory
+
+// Sends one message. Returns len, or -EMSGSIZE for one that can never fit
+// (bigger than the ring, or than the 32-bit length a record can carry).
+ssize_t ipc_send(struct ipc_client *client, const void *msg, size_t len);
+
+// Sends entries[0..count), filling in each one's status, and returns how many
+// went in. Without IPC_NONBLOCK it waits for room as needed, so only messages
+// that can never go in (too big) are left out. With it, it stops at the
+// first message that doesn't fit and those from there on get -EAGAIN.
+long ipc_send_batch(struct ipc_client *client, struct ipc_batch_entry *entries, unsigned count);
+
+// Receives one message into buf. Returns its length, -EMSGSIZE if buf is too small.
+ssize_t ipc_recv(struct ipc_client *client, void *buf, size_t len);
+
+// Receives as many whole messages as fit in buf, framed like the ring
+// (IPC_READ_FRAMED), and returns the bytes used. Walk them with ipc_next_record().
+ssize_t ipc_recv_batch(struct ipc_client *client, void *buf, size_t len);
+
+// Waits up to timeout_ms (-1 = forever) for POLLIN and/or POLLOUT.
+// Returns the events that are ready, 0 on timeout.
+int ipc_wait(struct ipc_client *client, short events, int timeout_ms);
+
+// Moves a reader to the message numbered *seq and sets *seq to the number it
+// actually got to, see IOCTL_SEEK_SEQ in ipc_ring.h
+int ipc_seek(struct ipc_client *client, uint64_t *seq);
+
+// How many messages / bytes the channel keeps for readers that seek back,
+// see IOCTL_SET_RETENTION
+int ipc_set_retention(struct ipc_client *client, uint32_t messages, uint32_t bytes);
+
+// Size of the ring's data area, and changing it (device only)
+int ipc_ring_size(struct ipc_client *client);
+int ipc_set_ring_size(struct ipc_client *client, int size);
+
+// Steps through the records ipc_recv_batch() returned. Start with *pos = 0
+// and keep calling until it returns NULL; each call gives back the next
+// message and its length.
+static inline char *ipc_next_record(char *batch, size_t batch_len, size_t *pos, size_t *len) {
+    if (*pos + sizeof(struct ipc_record_hdr) > batch_len) {
+        return NULL;
+    }
+
+    struct ipc_record_hdr *hdr = (struct ipc_record_hdr *)(batch + *pos);
+    if (*pos + RECORD_SIZE(hdr->len) > batch_len) {
+        return NULL; // truncated, shouldn't happen
+    }
+
+    *pos += RECORD_SIZE(hdr->len);
+    *len = hdr->len;
+    return (char *)(hdr + 1);
+}
+
+// Sequence number of a message ipc_next_record() returned
+static inline uint64_t ipc_record_seq(const char *record) {
+    return ((const struct ipc_record_hdr *)record - 1)->seq;
+}
+
+// Building messages, without allocating
+//
+// unique_hash is djb2 (http://www.cse.yorku.ca/~oz/hash.html) over the
+// timestamp and PID in decimal, then the text. Feed the hash piece by piece
+// with ipc_hash_update(), starting from IPC_HASH_INIT.
+#define IPC_HASH_INIT 5381
+
+#define IPC_MESSAGE_SIZE(text_len) (sizeof(struct message_data) + (text_len))
+
+static inline int64_t ipc_hash_update(int64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+
+    while (len--)
+        hash = ((hash << 5) + hash) + *bytes++; /* hash * 33 + c */
+    return hash;
+}
+
+// Lays out a message in buf (at least IPC_MESSAGE_SIZE(text_len) bytes) and
+// returns its size, or 0 if buf is too small
+size_t ipc_message_build(void *buf, size_t buf_len, pid_t pid, time_t timestamp,
+                         const void *text, size_t text_len);
+
+#endif
@@ -0,0 +1,52 @@
+// Binary log format, written by the reader (-L dir) and read back by ipc_logq.
+//
+// The log is a directory of segments. Each segment is a pair of files:
+//
+//   seg-00000001.log  a struct ipc_log_segment_hdr, then one record per message
+//   seg-00000001.idx  a sparse index over the .log, one entry per block of records
+//
+// A record is a struct ipc_log_record followed by the raw message (a struct
+// message_data and its text, as the reader got it from the device), padded
+// to IPC_LOG_ALIGN. Records are only ever appended.
+//
+// Every IPC_LOG_BLOCK records the reader closes a block and appends an index
+// entry with where the block starts and the range of timestamps and writer
+// PIDs in it, so a query can skip whole blocks without looking at them. The
+// index entry is written after the records it covers, so it never points
+// past the end of the .log; records after the last entry (the reader
+// stopped mid-block) have to be scanned.
+//
+// Segments are numbered in the order they were written; the reader starts a
+// new one every time it starts and once the current one passes its size limit.
+#ifndef IPC_LOG_H
+#define IPC_LOG_H
+
+#include <stdint.h>
+
+#define IPC_LOG_MAGIC "IPCLOG1" // 8 bytes with the terminator
+#define IPC_LOG_ALIGN 8
+#define IPC_LOG_BLOCK 128 // records per index entry
+
+#define IPC_LOG_RECORD_SIZE(len) ((sizeof(struct ipc_log_record) + (len) + IPC_LOG_ALIGN - 1) & ~(size_t)(IPC_LOG_ALIGN - 1))
+
+struct ipc_log_segment_hdr {
+    char magic[8];     // IPC_LOG_MAGIC
+    uint32_t version;  // 1
+    uint32_t reserved;
+};
+
+struct ipc_log_record {
+    uint32_t len;      // bytes of message after this header
+    uint32_t reserved;
+};
+
+struct ipc_log_index {
+    uint64_t offset;   // first record of the block in the .log
+    uint32_t count;    // records in the block
+    uint32_t reserved;
+    int64_t min_time;  // smallest and largest message_data.timestamp in the block
+    int64_t max_time;
+    uint64_t pid_mask; // bit (writer_pid % 64) set for every writer in the block
+};
+
+#endif
@@ -0,0 +1,316 @@
+///<summary> Query tool for the reader's binary log (sudo ./reader -L dir).
+/// Maps every segment in the directory and prints, counts or replays the messages that match,
+/// using the sparse index to skip whole blocks that can't have any.
+///<summary>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>    // open()
+#include <unistd.h>   // close()
+#include <string.h>
+#include <limits.h>   // UINT_MAX
+#include <dirent.h>   // scandir() for the segments
+#include <errno.h>
+#include <sys/mman.h> // mmap() for the segments
+#include <sys/stat.h>
+#include "message.h"
+#include "ipc_client.h" // replaying, through the device or shared memory
+#include "ipc_log.h"
+
+// What to look for, unset fields match everything
+struct query {
+    int pid;         // -1 = any writer
+    int64_t from;    // timestamps, inclusive
+    int64_t to;
+};
+
+struct query query = { -1, INT64_MIN, INT64_MAX };
+
+int count_only = 0;
+struct ipc_client *replay = NULL; // the channel with -r
+unsigned long long matched = 0, replayed = 0, blocks_skipped = 0;
+
+// Messages waiting to be replayed, pointing straight into the mapped segments
+struct ipc_batch_entry pending[IPC_BATCH_MAX];
+unsigned pending_count = 0;
+
+// Hands the pending messages over, ipc_send_batch() waits for room as needed
+static int replay_flush(void) {
+    long written = ipc_send_batch(replay, pending, pending_count);
+
+    if (written < 0) {
+        errno = -written;
+        perror("Failed to replay messages");
+        return -1;
+    }
+
+    for (unsigned i = 0; i < pending_count; i++) {
+        if (pending[i].status < 0) {
+            fprintf(stderr, "Message dropped by the driver: %s\n", strerror(-pending[i].status));
+        }
+    }
+    replayed += written;
+    pending_count = 0;
+    return 0;
+}
+
+// One message that passed the query
+static int emit(struct message_data* msg, uint32_t len) {
+    matched++;
+
+    if (count_only) {
+        return 0;
+    }
+
+    if (replay) {
+        pending[pending_count].data = (uintptr_t)msg;
+        pending[pending_count].len = len;
+        pending[pending_count].status = 0;
+        if (++pending_count == IPC_BATCH_MAX) {
+            return replay_flush();
+        }
+        return 0;
+    }
+
+    // Same line the text log has, the message text runs to the end of the record
+    size_t text_len = len - sizeof(struct message_data);
+    if (text_len > msg->message_length) {
+        text_len = msg->message_length;
+    }
+    printf("|| Log | %d | Writer PID: %d || %.*s\n",
+           (int)msg->timestamp, msg->writer_pid, (int)text_len, msg->message);
+    return 0;
+}
+
+// Whether a block's index entry says it could have a match
+static int block_may_match(const struct ipc_log_index* block) {
+    if (block->max_time < query.from || block->min_time > query.to) {
+        return 0;
+    }
+    if (query.pid != -1 && !(block->pid_mask & (1ULL << ((unsigned)query.pid % 64)))) {
+        return 0;
+    }
+    return 1;
+}
+
+// Goes through up to limit records from pos, handing matches to emit() if
+// check is set. Stops early at a record cut short (the reader died halfway
+// through writing it).
+// Returns the offset it got to, or -1 if replaying failed.
+static long long scan_records(char* map, size_t size, size_t pos, unsigned limit, int check) {
+    while (limit-- > 0 && pos + sizeof(struct ipc_log_record) <= size) {
+        struct ipc_log_record* record = (struct ipc_log_record*)(map + pos);
+        size_t record_size = IPC_LOG_RECORD_SIZE(record->len);
+
+        if (pos + record_size > size) {
+            break;
+        }
+
+        if (check && record->len >= sizeof(struct message_data)) {
+            struct message_data* msg = (struct message_data*)(record + 1);
+
+            if ((query.pid == -1 || msg->writer_pid == query.pid) &&
+                msg->timestamp >= query.from && msg->timestamp <= query.to &&
+                emit(msg, record->len) == -1) {
+                return -1;
+            }
+        }
+        pos += record_size;
+    }
+    return pos;
+}
+
+// Queries one segment, with its index if it has one
+static int query_segment(const char* dir_path, const char* name) {
+    char path[512];
+    struct stat st;
+    struct ipc_log_index* index = NULL;
+    size_t index_count = 0, index_size = 0;
+    int retval = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", dir_path, name);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return 0; // carry on with the others
+    }
+
+    size_t size = st.st_size;
+    if (size < sizeof(struct ipc_log_segment_hdr)) {
+        close(fd);
+        return 0; // just created, nothing in it
+    }
+
+    char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return 0;
+    }
+
+    if (memcmp(map, IPC_LOG_MAGIC, sizeof(IPC_LOG_MAGIC)) != 0) {
+        fprintf(stderr, "%s: not a log segment\n", path);
+        munmap(map, size);
+        return 0;
+    }
+
+    // seg-N.log -> seg-N.idx, a missing index just means scanning everything
+    snprintf(path + strlen(path) - 3, 4, "idx");
+    fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(*index)) {
+            index_size = st.st_size;
+            index = mmap(NULL, index_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (index == MAP_FAILED) {
+                index = NULL;
+            } else {
+                index_count = index_size / sizeof(*index);
+            }
+        }
+        close(fd);
+    }
+
+    // Matching blocks get read front to back, tell the kernel to read ahead
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    long long pos = sizeof(struct ipc_log_segment_hdr);
+    for (size_t i = 0; i < index_count && pos >= 0; i++) {
+        struct ipc_log_index* block = &index[i];
+
+        if (block->offset < (unsigned long long)pos || block->offset >= size) {
+            break; // doesn't line up with the segment, scan the rest instead
+        }
+        pos = block->offset;
+
+        if (block_may_match(block)) {
+            pos = scan_records(map, size, pos, block->count, 1);
+        } else if (i + 1 < index_count) {
+            pos = index[i + 1].offset; // skip it without touching it
+            blocks_skipped++;
+        } else {
+            pos = scan_records(map, size, pos, block->count, 0); // last one, find where it ends
+            blocks_skipped++;
+        }
+    }
+
+    // Whatever the index doesn't cover yet
+    if (pos >= 0) {
+        pos = scan_records(map, size, pos, UINT_MAX, 1);
+    }
+    if (pos < 0 || (replay && replay_flush() == -1)) {
+        retval = -1;
+    }
+
+    // Replayed messages point into the mapping, so it has to stay until they're flushed
+    if (index) {
+        munmap(index, index_size);
+    }
+    munmap(map, size);
+    return retval;
+}
+
+static int is_segment(const struct dirent* entry) {
+    unsigned number;
+    char suffix[8];
+
+    return sscanf(entry->d_name, "seg-%u.%7s", &number, suffix) == 2 && strcmp(suffix, "log") == 0;
+}
+
+// Usage: ipc_logq [-p pid] [-s from] [-e to] [-c] [-r] [-d device] [-U] dir
+//   -p 1234       only messages from that writer
+//   -s / -e       only messages timestamped from / to then (seconds since the epoch, inclusive)
+//   -c            just count the matches
+//   -r            write the matches back into the device instead of printing them
+//   -d device     which device -r writes to (default /dev/ipc_device)
+//   -U            with -r, writes to the shared memory ring even if the module is loaded
+int main(int argc, char* argv[]) {
+    const char* program = argv[0];
+    const char* device = IPC_DEFAULT_DEVICE;
+    enum ipc_backend backend = IPC_BACKEND_AUTO;
+    int replay_wanted = 0;
+    int bad_args = 0;
+    struct dirent** segments;
+
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-c") == 0) {
+            count_only = 1;
+            argv++;
+            argc--;
+            continue;
+        }
+        if (strcmp(argv[1], "-r") == 0) {
+            replay_wanted = 1;
+            argv++;
+            argc--;
+            continue;
+        }
+        if (strcmp(argv[1], "-U") == 0) {
+            backend = IPC_BACKEND_SHM;
+            argv++;
+            argc--;
+            continue;
+        }
+
+        if (argc > 2 && strcmp(argv[1], "-p") == 0) {
+            query.pid = atoi(argv[2]);
+        } else if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+            query.from = atoll(argv[2]);
+        } else if (argc > 2 && strcmp(argv[1], "-e") == 0) {
+            query.to = atoll(argv[2]);
+        } else if (argc > 2 && strcmp(argv[1], "-d") == 0) {
+            device = argv[2];
+        } else {
+            bad_args = 1; // unknown option
+            break;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (bad_args || argc != 2 || (count_only && replay_wanted)) {
+        printf("Expected format: %s [-p pid] [-s from] [-e to] [-c | -r [-d device] [-U]] dir\n", program);
+        return 1;
+    }
+
+    if (replay_wanted) {
+        replay = ipc_open(device, IPC_WRITE, backend);
+        if (!replay) {
+            perror("Failed to open device");
+            return 1;
+        }
+    }
+
+    // Zero padded numbers, so alphabetical is the order they were written in
+    int n = scandir(argv[1], &segments, is_segment, alphasort);
+    if (n == -1) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    // Lots of small lines, don't write() each one
+    static char out[1 << 16];
+    setvbuf(stdout, out, _IOFBF, sizeof(out));
+
+    int retval = 0;
+    for (int i = 0; i < n; i++) {
+        if (retval == 0 && query_segment(argv[1], segments[i]->d_name) == -1) {
+            retval = 1;
+        }
+        free(segments[i]);
+    }
+    free(segments);
+
+    if (count_only) {
+        printf("%llu\n", matched);
+    } else if (replay_wanted) {
+        printf("Replayed %llu of %llu messages\n", replayed, matched);
+    }
+    fflush(stdout);
+    fprintf(stderr, "%d segments, %llu blocks skipped by the index\n", n, blocks_skipped);
+
+    ipc_close(replay);
+    return retval;
+}
@@ -0,0 +1,2779 @@
+#include <linux/kernel.h> // core kernel func and macros
+#include <linux/init.h> // module init and exit
+#include <linux/fs.h> // File operations
+#include <linux/uaccess.h> // for copy_to_user()
+#include <linux/mutex.h>
+#include <linux/percpu-rwsem.h> // guards the ring against resizes without readers sharing a cache line
+#include <linux/crypto.h>   // Encryption
+#include <crypto/aead.h>     // AES-GCM / ChaCha20-Poly1305 transforms
+#include <linux/scatterlist.h>
+#include <linux/random.h>    // nonces
+#include <linux/slab.h>      // Memory allocation
+#include <linux/mm.h>        // Shared memory
+#include <linux/cdev.h> // registering character devices
+#include <linux/proc_fs.h>  // for proc_create and remove_proc_entry
+#include <linux/seq_file.h> // /proc/ipc_stats
+#include <linux/percpu.h>   // per-CPU stats counters
+#include <linux/ioctl.h> // for the ioctl commands
+#include <linux/vmalloc.h> // page-backed ring that can be mmap'd
+#include <linux/wait.h> // wait queues for blocking reads
+#include <linux/poll.h> // poll/epoll support
+#include <linux/workqueue.h> // encrypting off the write() path
+#include <linux/moduleparam.h>
+#include <linux/ktime.h> // timing the ciphers for the tracepoints
+#include <linux/kref.h> // channels live until their last file is closed
+#include <linux/capability.h>
+#include <linux/hash.h> // hash_64() for the dedup buckets
+#include <linux/list.h>
+#include <linux/lz4.h> // IOCTL_SET_COMPRESS, needs a kernel with CONFIG_LZ4_COMPRESS and CONFIG_LZ4_DECOMPRESS
+
+#include "ipc_ring.h" // ring layout shared with userspace
+#include "message.h" // what writers send, only used to check IPC_DEDUP_HASH_OFFSET
+#include "crypto_lib.h" // the legacy cipher's lookup tables
+
+#define CREATE_TRACE_POINTS
+#include "ipc_trace.h" // tracepoints, see the header for how to turn them on
+
+#define DEVICE_NAME "Simple IPC" 
+#define MAJOR_DEVICE_NUMBER IPC_IOCTL_MAGIC // the ioctl numbers are built on it too
+#define MINOR_DEVICE_NUMBER 0
+#define RING_DEFAULT_SIZE 1024 // bytes of records in a new channel's ring
+#define RING_MAX_SIZE (64 << 20) // biggest ring IOCTL_SET_SHM_SIZE will make, 64 MB
+
+#define PROC_FILENAME "ipc_stats"
+#define PROC_LATENCY_FILENAME "ipc_latency"
+
+// The ioctl commands are in ipc_ring.h, userspace uses the same ones
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("");
+MODULE_DESCRIPTION("A simple IPC driver");
+MODULE_VERSION("1.0");
+
+static struct class *ipc_class = NULL;
+
+// The legacy cipher's key, its tables are built once when the module loads
+// and only read after that. Its scratch space is per channel, see struct ipc_channel.
+static struct legacy_key legacy_key;
+
+// https://www.kernel.org/doc/html/latest/crypto/api-aead.html
+// The AEAD transforms are allocated once per channel when it's created;
+// IOCTL_SET_KEY picks one and installs its key. Encrypted records are stored in the ring as
+// nonce | ciphertext | tag and decrypted separately for each reader on the
+// way out, into the reader's own buffer. Unless async_crypto is on (below),
+// the plaintext never sits in shared memory.
+#define AEAD_NONCE_SIZE 12
+#define AEAD_TAG_SIZE 16
+#define AEAD_OVERHEAD (AEAD_NONCE_SIZE + AEAD_TAG_SIZE)
+
+// https://www.kernel.org/doc/html/latest/core-api/workqueue.html
+// With async_crypto set, write() only copies the message into the ring and
+// queues crypt_work. The worker encrypts everything written since it last
+// ran and then moves the head up, so readers only ever see finished records
+// and neither write() nor read() waits on the cipher (or on the legacy cipher's lock).
+// Until the worker gets to them, pending records sit in the ring as plaintext.
+// They're past the head so nobody can pop them, but the ring's pages are the
+// ones a process gets with mmap(), and it can read them there for as long as
+// the worker takes. Leave async_crypto off if that window matters.
+static bool async_crypto;
+module_param(async_crypto, bool, 0444);
+MODULE_PARM_DESC(async_crypto, "Encrypt messages on a workqueue instead of inside write()");
+
+static struct workqueue_struct *crypt_wq; // shared by every channel
+static void ring_crypt_work(struct work_struct *work);
+
+// Per-reader state, for files opened for reading
+struct ipc_reader {
+    struct mutex lock; // threads sharing the file take turns moving its cursor
+    int slot;          // cursor slot in the control page
+    int read_mode;     // IPC_READ_SINGLE or IPC_READ_FRAMED
+    char *bounce;      // decrypted payloads land here before going out to userspace
+    size_t bounce_size;
+    char *inflate;     // and decompressed ones here
+    size_t inflate_size;
+    struct aead_request *gcm_req;    // decryption requests, allocated on first use
+    struct aead_request *chacha_req;
+};
+
+static struct proc_dir_entry *proc_file;
+
+//Proc File stats variables 
+// https://www.kernel.org/doc/html/latest/core-api/this_cpu_ops.html
+// Each CPU counts into its own copy, so updating them needs no lock and no
+// shared cache line. They're only added up when someone asks for the stats,
+// see stats_fold().
+struct ipc_cpu_stats {
+    u64 userspace_accesses;
+    u64 total_bytes_read;
+    u64 total_bytes_write;
+    u64 reads_count;
+    u64 writes_count;
+    u64 max_written;
+    u64 min_written; // only meaningful once this CPU has seen a write
+    u64 duplicates;  // writes dropped because their unique_hash was already queued
+    u64 compressed;  // see struct ipc_stats
+    u64 compress_skipped;
+    u64 compress_bytes_in;
+    u64 compress_bytes_out;
+    u64 compress_ns;
+    u64 decompress_ns;
+};
+
+// Latency histograms, also per CPU
+// Every message's trip is timed in stages, each stage gets a histogram with
+// log2 buckets: bucket b counts times in [2^(b-1), 2^b) ns, bucket 0 counts 0.
+// /proc/ipc_latency prints p50/p99/p999 for each, IOCTL_RESET_LATENCY clears them.
+enum ipc_lat_stage {
+    LAT_ENQUEUE_WAIT, // write() waiting for the write lock
+    LAT_ENCRYPT,      // encrypting one message
+    LAT_QUEUE,        // write() queued it until a read() delivered it
+    LAT_DECRYPT,      // decrypting one message
+    LAT_COPY_OUT,     // copying to the reader's buffer
+    LAT_STAGES,
+};
+
+static const char *const lat_stage_names[LAT_STAGES] = {
+    "enqueue_wait", "encrypt", "queue", "decrypt", "copy_out",
+};
+
+#define LAT_BUCKETS 64
+
+struct ipc_cpu_latency {
+    u64 buckets[LAT_STAGES][LAT_BUCKETS];
+};
+
+static bool latency_stats = true;
+module_param(latency_stats, bool, 0644);
+MODULE_PARM_DESC(latency_stats, "Time each stage of a message's trip for /proc/ipc_latency");
+
+
+// CHANNELS
+// Every minor number is its own channel, /dev/ipc_device for minor 0 and
+// /dev/ipc_deviceN for the rest, each with its own ring, locks, keys and
+// stats, so unrelated workloads don't queue behind each other. The channels
+// module parameter says how many exist at load time, IOCTL_CREATE_CHANNEL and
+// IOCTL_DESTROY_CHANNEL add and remove them later.
+#define IPC_MAX_CHANNELS 64
+
+static int channels = 1;
+module_param(channels, int, 0444);
+MODULE_PARM_DESC(channels, "Number of channels to create at load time (1-64)");
+
+// DUPLICATE SUPPRESSION
+// With a window set, a channel remembers the unique_hash of the last that many
+// messages written to it (see IPC_DEDUP_HASH_OFFSET) in a hash table, and a
+// write whose hash is in there is reported as done without being queued
+// again. The window is a FIFO: once it's full each new hash pushes out the
+// oldest one.
+static int dedup_window;
+module_param(dedup_window, int, 0444);
+MODULE_PARM_DESC(dedup_window, "Recent unique_hash values each new channel remembers to drop duplicates, 0 for off");
+
+// RETENTION
+// Records a channel keeps after every reader is done with them, so a reader
+// that restarts can seek back to the last message it handled instead of
+// losing everything written while it was gone. See IOCTL_SET_RETENTION in
+// ipc_ring.h, these are what new channels start with.
+static int retain_messages;
+module_param(retain_messages, int, 0444);
+MODULE_PARM_DESC(retain_messages, "Most recent messages each new channel keeps for readers that seek back, 0 for none");
+
+static int retain_bytes;
+module_param(retain_bytes, int, 0444);
+MODULE_PARM_DESC(retain_bytes, "Most recent bytes of messages each new channel keeps for readers that seek back, 0 for none");
+
+struct ipc_dedup_entry {
+    struct hlist_node node; // in the bucket for hash, unhashed while the slot is empty
+    u64 hash;
+};
+
+struct ipc_channel {
+    int minor;
+    struct kref ref;       // one for the channel table, one for every open file
+    struct device *device; // the /dev node
+
+    // Shared memory is used as a ring of framed messages. Every write() becomes
+    // one record: a small header holding the payload length, followed by the
+    // payload itself, padded so the next header starts on an aligned offset.
+    // The ring lives in vmalloc'd pages so user programs can mmap it and move
+    // messages without a syscall each, see ipc_ring.h for the layout.
+    char *ring_mem;                  // control page followed by the data pages
+    struct ipc_ring_ctrl *ring_ctrl; // producer/consumer indices, also visible through mmap
+    char *shared_mem;                // data area of the ring
+    size_t shm_size;
+    atomic_t ring_mappings;          // live mmaps, the ring can't be swapped out while mapped
+
+    // https://0xax.gitbooks.io/linux-insides/content/SyncPrim/linux-sync-5.html
+    // https://docs.kernel.org/locking/percpu-rw-semaphore.html
+    // Everything that touches the ring holds this for reading, which only bumps a
+    // per-CPU counter, so any number of readers and writers go through at once.
+    // Only a resize or a key change takes it for writing.
+    struct percpu_rw_semaphore ring_rwsem;
+
+    // Every file opened for reading has its own cursor into the ring, kept in a
+    // slot of the control page so mmap readers can use it too. Readers only ever
+    // move their own cursor and writers only move the head (and the tail, up to
+    // the slowest cursor, when they need space), so readers never wait on each
+    // other or on writers.
+    struct mutex ring_write_lock;                // one writer appends at a time, also guards reader_slots
+    u64 reader_slots[IPC_RING_MAX_READERS / 64]; // cursor slots in use, mirrored into the control page
+    atomic_t open_readers;                       // files currently open for reading
+
+    // Retention window, also guarded by ring_write_lock and mirrored into the
+    // control page. The window counts back from ctrl->seq, which an mmap
+    // producer bumps too, so it's only as right as they keep it.
+    u32 retain_messages;
+    u32 retain_bytes;
+
+    // https://embetronicx.com/tutorials/linux/device-drivers/waitqueue-in-linux-device-driver-tutorial/
+    // Sleepers only watch ring_events, never the ring itself, so a resize can
+    // free the old ring without pulling it out from under someone waiting on it.
+    wait_queue_head_t ring_readable; // readers waiting for a record
+    wait_queue_head_t ring_writable; // pollers waiting for free space
+    atomic_t ring_events;            // bumped whenever the ring changes
+
+    // Each channel has its own transforms, so setting a key on one leaves the others alone
+    struct crypto_aead *gcm_tfm;    // gcm(aes), NULL if the kernel doesn't have it
+    struct crypto_aead *chacha_tfm; // rfc7539(chacha20,poly1305), NULL if the kernel doesn't have it
+    struct aead_request *gcm_req;    // encryption requests for each, used by write() or the worker
+    struct aead_request *chacha_req;
+    int cipher_mode;                // what new records get encrypted with
+    struct crypto_aead *cipher_tfm; // transform for cipher_mode, NULL unless it's an AEAD
+    u8 nonce_salt[4];               // random per key
+    u64 nonce_counter;              // starts random per key, bumped for every record
+    char *write_bounce;             // encrypted records get built here, guarded by ring_write_lock
+    size_t write_bounce_size;
+
+    // Scratch space for the legacy cipher, grown to fit the biggest message it has seen.
+    // Every channel has its own, so channels using it don't wait on each other.
+    struct mutex crypto_lock;   // guards the three below
+    u16 *encrypted_mem;         // holds encrypted data, one 16-bit word per byte of message
+    u8 *decrypted_mem;          // the message, copied out of the ring to be encrypted
+    size_t legacy_scratch_size; // bytes of message both have room for
+
+    // Compression, guarded by ring_write_lock. Messages are compressed from
+    // compress_src into write_bounce, right where aead_seal() wants them.
+    int compress_mode;   // IPC_COMPRESS_*
+    void *lz4_wrkmem;    // LZ4's hash table, LZ4_MEM_COMPRESS bytes while compress_mode is LZ4
+    char *compress_src;  // the message, copied in from userspace
+    size_t compress_src_size;
+
+    struct work_struct crypt_work; // async_crypto: encrypts and publishes pending records
+    u64 ring_reserved;             // end of the last record written, may be ahead of the head while the worker catches up
+    char *crypt_bounce;            // the worker's version of write_bounce
+    size_t crypt_bounce_size;
+
+    struct ipc_cpu_stats __percpu *stats;
+    struct ipc_cpu_latency __percpu *latency;
+
+    // Duplicate suppression, guarded by ring_write_lock
+    struct hlist_head *dedup_buckets;      // 1 << dedup_bits of them
+    struct ipc_dedup_entry *dedup_entries; // the window, reused oldest first
+    int dedup_size;                        // entries in the window, 0 when dedup is off
+    int dedup_bits;
+    int dedup_next;                        // entry the next hash goes in
+};
+
+static struct ipc_channel *channel_table[IPC_MAX_CHANNELS]; // indexed by minor, NULL for unused minors
+static DEFINE_MUTEX(channels_lock); // guards channel_table
+
+// Per-open state, kept in file->private_data
+struct ipc_file {
+    struct ipc_channel *chan;  // channel of the minor that was opened
+    struct ipc_reader *reader; // NULL until the file has a cursor, see file_reader()
+};
+
+
+// Function prototypes
+static int device_open(struct inode *inode, struct file *file);
+static int file_reader(struct file *file, struct ipc_reader **out);
+static int device_closed(struct inode *inode, struct file *file);
+static ssize_t device_read(struct file *file, char __user *user_buffer, size_t len, loff_t *offset);
+static ssize_t device_write(struct file *file, const char __user *user_buffer, size_t len, loff_t *offset);
+static int stats_show(struct seq_file *m, void *v);
+static void stats_fold(struct ipc_channel *chan, struct ipc_stats *out);
+static int latency_show(struct seq_file *m, void *v);
+static void latency_reset(struct ipc_channel *chan);
+static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static int device_mmap(struct file *file, struct vm_area_struct *vma);
+static __poll_t device_poll(struct file *file, poll_table *wait);
+static void ring_notify(struct ipc_channel *chan);
+static long ring_write_batch(struct ipc_channel *chan, struct ipc_batch __user *user_batch);
+static u64 ring_slowest_reader(struct ipc_channel *chan, u64 head, u64 tail);
+static u64 ring_reclaim_limit(struct ipc_channel *chan, u64 head, u64 tail, u64 need);
+static long ring_seek(struct ipc_channel *chan, struct ipc_reader *reader, u64 __user *user_seq);
+static long ring_set_retention(struct ipc_channel *chan, struct ipc_retention __user *user_retention);
+static long lz4_set_mode(struct ipc_channel *chan, int mode);
+static u64 ring_write_head(struct ipc_channel *chan);
+static long crypto_set_key(struct ipc_channel *chan, struct ipc_key __user *user_key);
+
+
+
+static char *ring_alloc(size_t size);
+static void ring_install(struct ipc_channel *chan, char *mem);
+static int ring_resize(struct ipc_channel *chan, int size);
+static u32 ring_record_len(struct ipc_channel *chan, u64 off);
+static u32 ring_message_len(struct ipc_channel *chan, u64 off);
+static void ring_copy_out(struct ipc_channel *chan, void *dst, u64 off, size_t len);
+
+
+static int ipc_proc_init(void);
+static void ipc_proc_exit(void); 
+
+static struct ipc_channel *channel_create(int minor);
+static void channel_destroy(struct ipc_channel *chan);
+static void channel_release(struct kref *ref);
+static int dedup_set_window(struct ipc_channel *chan, int window);
+static void dedup_free(struct ipc_channel *chan);
+
+// File operation structure
+// .owner makes every open file hold a reference on the module, so it can't
+// be unloaded while a file, or a mapping (which holds its file), is still open
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .open = device_open,
+    .release = device_closed,
+    .read = device_read,
+    .write = device_write,
+    .unlocked_ioctl = device_ioctl,
+    .mmap = device_mmap,
+    .poll = device_poll,
+};
+
+
+// Intialising
+static int __init device_init(void) {
+    struct ipc_channel *chan;
+    int retval, i;
+
+    // Dedup reads the hash out of messages at a fixed offset, writer.c checks the same
+    BUILD_BUG_ON(offsetof(struct message_data, unique_hash) != IPC_DEDUP_HASH_OFFSET);
+
+    // RSA Key Generation - hardcoded for now
+    retval = legacy_key_init(&legacy_key, 61, 53, 17);
+    if (retval) {
+        printk(KERN_ALERT "Failed to set up the legacy cipher\n");
+        return retval;
+    }
+
+    retval = register_chrdev(MAJOR_DEVICE_NUMBER, DEVICE_NAME, &fops);  // register the device
+
+    if (retval == 0) {
+        printk("dev_testdr registered to major number %d and minor number %d\n", MAJOR_DEVICE_NUMBER, MINOR_DEVICE_NUMBER);
+    } else {
+        printk("Could not register dev_testdr\n");
+        legacy_key_free(&legacy_key);
+        return retval;
+    }
+
+    //Create device class
+    ipc_class = class_create("ipc_class");
+    if (IS_ERR(ipc_class)) {
+        unregister_chrdev(MAJOR_DEVICE_NUMBER, DEVICE_NAME);
+        legacy_key_free(&legacy_key);
+        printk(KERN_ALERT "Failed to create device class\n");
+        return PTR_ERR(ipc_class);
+    }
+
+    BUILD_BUG_ON(sizeof(struct ipc_ring_ctrl) > PAGE_SIZE);
+
+    if (async_crypto) {
+        // Unbound so the encryption runs on whichever CPU is free, not the writer's
+        crypt_wq = alloc_workqueue("ipc_crypt", WQ_UNBOUND, 0);
+        if (!crypt_wq) {
+            printk(KERN_WARNING "Couldn't create the crypto workqueue, encrypting in write()\n");
+            async_crypto = false;
+        }
+    }
+
+    if (channels < 1 || channels > IPC_MAX_CHANNELS) {
+        printk(KERN_WARNING "channels=%d is out of range, creating 1\n", channels);
+        channels = 1;
+    }
+
+    // Every channel gets its own ring and device node
+    mutex_lock(&channels_lock);
+    for (i = 0; i < channels; i++) {
+        chan = channel_create(i);
+        if (IS_ERR(chan)) {
+            printk(KERN_ALERT "Failed to create channel %d\n", i);
+            retval = PTR_ERR(chan);
+            goto out;
+        }
+    }
+    mutex_unlock(&channels_lock);
+
+    ipc_proc_init();
+
+    printk(KERN_INFO "Device registered with major number %d, %d channel(s)\n", MAJOR_DEVICE_NUMBER, channels);
+    return 0; 
+
+out:
+    for (i = 0; i < IPC_MAX_CHANNELS; i++) {
+        if (channel_table[i])
+            channel_destroy(channel_table[i]);
+    }
+    mutex_unlock(&channels_lock);
+    if (crypt_wq)
+        destroy_workqueue(crypt_wq);
+    class_destroy(ipc_class);
+    unregister_chrdev(MAJOR_DEVICE_NUMBER, DEVICE_NAME);
+    legacy_key_free(&legacy_key);
+    return retval;
+}
+
+/* https://devarea.com/linux-kernel-development-creating-a-proc-file-and-interfacing-with-user-space/ */
+
+//Initialising proc file
+static int __init ipc_proc_init(void) {
+    proc_file = proc_create_single(PROC_FILENAME, 0444, NULL, stats_show); // read only proc file
+    if (!proc_file) {
+        printk(KERN_ALERT "Failed to create proc file \n");
+        return -ENOMEM;
+    }
+    if (!proc_create_single(PROC_LATENCY_FILENAME, 0444, NULL, latency_show)) {
+        printk(KERN_ALERT "Failed to create latency proc file \n");
+        remove_proc_entry(PROC_FILENAME, NULL);
+        return -ENOMEM;
+    }
+    printk(KERN_INFO "Proc file created \n");
+    return 0;
+}
+
+// Cleaning up the device
+static void __exit device_exit(void) {
+    int i;
+
+    // Nothing can have a channel open any more, so this frees them all
+    mutex_lock(&channels_lock);
+    for (i = 0; i < IPC_MAX_CHANNELS; i++) {
+        if (channel_table[i])
+            channel_destroy(channel_table[i]); // Remove the device
+    }
+    mutex_unlock(&channels_lock);
+
+    class_destroy(ipc_class); // Remove the device class
+    unregister_chrdev(MAJOR_DEVICE_NUMBER, DEVICE_NAME);  // Unregister the device
+
+    if (crypt_wq)
+        destroy_workqueue(crypt_wq);
+
+    legacy_key_free(&legacy_key);
+
+    printk(KERN_INFO "Device unregistered\n");
+
+    ipc_proc_exit();
+}
+
+//Clean-up proc
+static void __exit ipc_proc_exit(void) {
+    remove_proc_entry(PROC_LATENCY_FILENAME, NULL);
+    remove_proc_entry(PROC_FILENAME, NULL);
+}
+
+// CHANNELS
+// Frees everything a channel owns, it may be only partly set up
+static void channel_free(struct ipc_channel *chan) {
+    cancel_work_sync(&chan->crypt_work); // the worker may still be encrypting into the ring
+
+    vfree(chan->ring_mem);
+    aead_request_free(chan->gcm_req);
+    aead_request_free(chan->chacha_req);
+    if (chan->gcm_tfm)
+        crypto_free_aead(chan->gcm_tfm);
+    if (chan->chacha_tfm)
+        crypto_free_aead(chan->chacha_tfm);
+    kvfree_sensitive(chan->write_bounce, chan->write_bounce_size);
+    kvfree_sensitive(chan->crypt_bounce, chan->crypt_bounce_size);
+    kvfree_sensitive(chan->compress_src, chan->compress_src_size);
+    kvfree(chan->lz4_wrkmem);
+    kvfree(chan->encrypted_mem);
+    kvfree(chan->decrypted_mem);
+    dedup_free(chan);
+    free_percpu(chan->stats);
+    free_percpu(chan->latency);
+    percpu_free_rwsem(&chan->ring_rwsem);
+    kfree(chan);
+}
+
+// Called once the channel is out of the table and its last file is closed
+static void channel_release(struct kref *ref) {
+    channel_free(container_of(ref, struct ipc_channel, ref));
+}
+
+// Sets up the channel on minor and its device node
+// Caller holds channels_lock, the minor has to be free
+static struct ipc_channel *channel_create(int minor) {
+    struct ipc_channel *chan;
+    int retval = -ENOMEM;
+
+    chan = kzalloc(sizeof(*chan), GFP_KERNEL);
+    if (!chan) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    chan->minor = minor;
+    kref_init(&chan->ref); // the channel table's reference
+    mutex_init(&chan->ring_write_lock);
+    mutex_init(&chan->crypto_lock);
+    init_waitqueue_head(&chan->ring_readable);
+    init_waitqueue_head(&chan->ring_writable);
+    INIT_WORK(&chan->crypt_work, ring_crypt_work);
+    chan->cipher_mode = IPC_CIPHER_LEGACY;
+    chan->retain_messages = max(retain_messages, 0);
+    chan->retain_bytes = clamp(retain_bytes, 0, RING_MAX_SIZE);
+
+    if (percpu_init_rwsem(&chan->ring_rwsem)) {
+        kfree(chan);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    chan->stats = alloc_percpu(struct ipc_cpu_stats);
+    chan->latency = alloc_percpu(struct ipc_cpu_latency);
+
+    // allocating the ring pages for shared memory
+    ring_install(chan, ring_alloc(RING_DEFAULT_SIZE));
+    if (!chan->stats || !chan->latency || !chan->ring_mem) {
+        printk(KERN_ALERT "memory allocation failed\n");
+        goto out;
+    }
+
+    // Transforms are set up once here so encrypting a message only costs the cipher itself
+    chan->gcm_tfm = crypto_alloc_aead("gcm(aes)", 0, 0);
+    if (IS_ERR(chan->gcm_tfm)) {
+        printk(KERN_WARNING "gcm(aes) not available, AES-GCM disabled\n");
+        chan->gcm_tfm = NULL;
+    }
+
+    chan->chacha_tfm = crypto_alloc_aead("rfc7539(chacha20,poly1305)", 0, 0);
+    if (IS_ERR(chan->chacha_tfm)) {
+        printk(KERN_WARNING "rfc7539(chacha20,poly1305) not available, ChaCha20-Poly1305 disabled\n");
+        chan->chacha_tfm = NULL;
+    }
+
+    // Same for the requests that encrypt with them, write() and the worker never run together
+    if (chan->gcm_tfm && !(chan->gcm_req = aead_request_alloc(chan->gcm_tfm, GFP_KERNEL))) {
+        crypto_free_aead(chan->gcm_tfm);
+        chan->gcm_tfm = NULL;
+    }
+    if (chan->chacha_tfm && !(chan->chacha_req = aead_request_alloc(chan->chacha_tfm, GFP_KERNEL))) {
+        crypto_free_aead(chan->chacha_tfm);
+        chan->chacha_tfm = NULL;
+    }
+
+    if (dedup_set_window(chan, dedup_window)) {
+        printk(KERN_WARNING "Couldn't set up a dedup window of %d on channel %d\n", dedup_window, minor);
+    }
+
+    // Create device node - this makes the device appear in /dev/
+    // Channel 0 keeps the name it always had
+    if (minor == 0) {
+        chan->device = device_create(ipc_class, NULL, MKDEV(MAJOR_DEVICE_NUMBER, 0), NULL, "ipc_device");
+    } else {
+        chan->device = device_create(ipc_class, NULL, MKDEV(MAJOR_DEVICE_NUMBER, minor), NULL, "ipc_device%d", minor);
+    }
+    if (IS_ERR(chan->device)) {
+        printk(KERN_ALERT "Failed to create device\n");
+        retval = PTR_ERR(chan->device);
+        goto out;
+    }
+
+    channel_table[minor] = chan;
+    return chan;
+
+out:
+    channel_free(chan);
+    return ERR_PTR(retval);
+}
+
+// Takes the channel's device node away. Files that still have it open keep
+// working and the channel is freed when the last of them is closed.
+// Caller holds channels_lock
+static void channel_destroy(struct ipc_channel *chan) {
+    device_destroy(ipc_class, MKDEV(MAJOR_DEVICE_NUMBER, chan->minor));
+    channel_table[chan->minor] = NULL;
+    kref_put(&chan->ref, channel_release);
+}
+
+// IOCTL_CREATE_CHANNEL
+// Sets up a channel on the lowest free minor number and hands that back
+static long channel_add(int __user *user_minor) {
+    struct ipc_channel *chan;
+    long retval = 0;
+    int minor;
+
+    if (!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+    }
+
+    mutex_lock(&channels_lock);
+
+    for (minor = 0; minor < IPC_MAX_CHANNELS; minor++) {
+        if (!channel_table[minor])
+            break;
+    }
+    if (minor == IPC_MAX_CHANNELS) {
+        retval = -ENOSPC;
+        goto out;
+    }
+
+    chan = channel_create(minor);
+    if (IS_ERR(chan)) {
+        retval = PTR_ERR(chan);
+        goto out;
+    }
+    printk(KERN_INFO "Created channel %d\n", minor);
+
+    if (copy_to_user(user_minor, &minor, sizeof(minor))) {
+        retval = -EFAULT; // the channel stays, it shows up in /dev anyway
+    }
+
+out:
+    mutex_unlock(&channels_lock);
+    return retval;
+}
+
+// IOCTL_DESTROY_CHANNEL
+// Channel 0 is the one the module was loaded for, it can't be removed
+static long channel_remove(int minor) {
+    long retval = 0;
+
+    if (!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+    }
+    if (minor <= 0 || minor >= IPC_MAX_CHANNELS) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&channels_lock);
+    if (channel_table[minor]) {
+        channel_destroy(channel_table[minor]);
+        printk(KERN_INFO "Destroyed channel %d\n", minor);
+    } else {
+        retval = -ENODEV;
+    }
+    mutex_unlock(&channels_lock);
+
+    return retval;
+}
+
+static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct ipc_file *f = file->private_data;
+    struct ipc_channel *chan = f->chan;
+    struct ipc_reader *reader;
+    int retval = 0;
+    int temp;
+    u64 cursor;
+
+    // https://www.geeksforgeeks.org/c-switch-statement/
+    switch (cmd) {
+        // Get shared memory size
+        case IOCTL_GET_SHM_SIZE:
+            temp = chan->shm_size;
+            if (copy_to_user((int __user *)arg, &temp, sizeof(temp))) {
+                retval = -EFAULT;
+            }
+            break;
+
+        // Set shared memory size
+        case IOCTL_SET_SHM_SIZE:
+            if (copy_from_user(&temp, (int __user *)arg, sizeof(temp))) {
+                retval = -EFAULT;
+            } else {
+                retval = ring_resize(chan, temp);
+            }
+            break;
+
+        // Get number of readers (there's no cap any more)
+        case IOCTL_GET_READER_COUNT:
+            temp = atomic_read(&chan->open_readers);
+            if (copy_to_user((int __user *)arg, &temp, sizeof(temp))) {
+                retval = -EFAULT;
+            }
+            break;
+
+        // Get size of the next message waiting for this reader (0 if none)
+        case IOCTL_GET_CURRENT_BUFFER_SIZE:
+            retval = file_reader(file, &reader);
+            if (retval) {
+                break;
+            }
+            temp = 0;
+            percpu_down_read(&chan->ring_rwsem);
+            cursor = READ_ONCE(chan->ring_ctrl->cursors[reader->slot]);
+            if (smp_load_acquire(&chan->ring_ctrl->head) != cursor) {
+                temp = ring_message_len(chan, cursor);
+                if (reader->read_mode == IPC_READ_FRAMED) {
+                    temp = RECORD_SIZE(temp); // framed reads hand out the header and padding too
+                }
+            }
+            percpu_up_read(&chan->ring_rwsem);
+            if (copy_to_user((int __user *)arg, &temp, sizeof(temp))) {
+                retval = -EFAULT;
+            }
+            break;
+
+        // Someone pushed or popped through the mapping, wake whoever is waiting
+        case IOCTL_RING_NOTIFY:
+            ring_notify(chan);
+            break;
+
+        // Append a whole array of messages at once
+        case IOCTL_WRITE_BATCH:
+            retval = ring_write_batch(chan, (struct ipc_batch __user *)arg);
+            break;
+
+        // Switch between one message per read() and framed batches
+        case IOCTL_SET_READ_MODE:
+            retval = file_reader(file, &reader);
+            if (retval) {
+                break;
+            }
+            if (copy_from_user(&temp, (int __user *)arg, sizeof(temp))) {
+                retval = -EFAULT;
+            } else if (temp == IPC_READ_SINGLE || temp == IPC_READ_FRAMED) {
+                mutex_lock(&reader->lock);
+                reader->read_mode = temp;
+                mutex_unlock(&reader->lock);
+            } else {
+                retval = -EINVAL;
+            }
+            break;
+
+        // Counters for monitoring, cheap enough to poll often
+        case IOCTL_GET_STATS: {
+            struct ipc_stats stats;
+
+            stats_fold(chan, &stats);
+            if (copy_to_user((struct ipc_stats __user *)arg, &stats, sizeof(stats))) {
+                retval = -EFAULT;
+            }
+            break;
+        }
+
+        // Start measuring latencies from scratch, e.g. before a benchmark run
+        case IOCTL_RESET_LATENCY:
+            latency_reset(chan);
+            break;
+
+        // Change cipher / key for messages written from now on
+        case IOCTL_SET_KEY:
+            retval = crypto_set_key(chan, (struct ipc_key __user *)arg);
+            break;
+
+        // Add or remove a channel, any channel's device will do
+        case IOCTL_CREATE_CHANNEL:
+            retval = channel_add((int __user *)arg);
+            break;
+
+        case IOCTL_DESTROY_CHANNEL:
+            if (copy_from_user(&temp, (int __user *)arg, sizeof(temp))) {
+                retval = -EFAULT;
+            } else {
+                retval = channel_remove(temp);
+            }
+            break;
+
+        // Start or stop dropping duplicate messages, the window starts out empty
+        case IOCTL_SET_DEDUP:
+            if (copy_from_user(&temp, (int __user *)arg, sizeof(temp))) {
+                retval = -EFAULT;
+                break;
+            }
+            mutex_lock(&chan->ring_write_lock);
+            retval = dedup_set_window(chan, temp);
+            mutex_unlock(&chan->ring_write_lock);
+            break;
+
+        // Resume from a sequence number, e.g. after the reader restarted
+        case IOCTL_SEEK_SEQ:
+            retval = file_reader(file, &reader);
+            if (retval) {
+                break;
+            }
+            retval = ring_seek(chan, reader, (u64 __user *)arg);
+            break;
+
+        case IOCTL_SET_RETENTION:
+            retval = ring_set_retention(chan, (struct ipc_retention __user *)arg);
+            break;
+
+        // Compress messages written from now on, or stop
+        case IOCTL_SET_COMPRESS:
+            if (copy_from_user(&temp, (int __user *)arg, sizeof(temp))) {
+                retval = -EFAULT;
+            } else {
+                retval = lz4_set_mode(chan, temp);
+            }
+            break;
+
+        // Which cursor slot an mmap reader should pop with
+        case IOCTL_GET_READER_SLOT:
+            retval = file_reader(file, &reader);
+            if (retval) {
+                break;
+            }
+            temp = reader->slot;
+            if (copy_to_user((int __user *)arg, &temp, sizeof(temp))) {
+                retval = -EFAULT;
+            }
+            break;
+
+        default:
+            retval = -EINVAL;
+            break;
+    }
+    
+    return retval;
+}
+
+
+// Gives the file a cursor slot starting at the current head, so it sees
+// every message written from now on. Does nothing if it already has one.
+static int reader_attach(struct ipc_file *f) {
+    struct ipc_channel *chan = f->chan;
+    struct ipc_reader *reader;
+    int slot;
+
+    reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+    if (!reader) {
+        return -ENOMEM;
+    }
+    mutex_init(&reader->lock);
+
+    // Holding the write lock means no record gets published or reclaimed
+    // while the new cursor is being set up
+    mutex_lock(&chan->ring_write_lock);
+    percpu_down_read(&chan->ring_rwsem);
+
+    if (f->reader) { // another thread sharing the file got there first
+        percpu_up_read(&chan->ring_rwsem);
+        mutex_unlock(&chan->ring_write_lock);
+        kfree(reader);
+        return 0;
+    }
+
+    for (slot = 0; slot < IPC_RING_MAX_READERS; slot++) {
+        if (!(chan->reader_slots[slot / 64] & BIT_ULL(slot % 64)))
+            break;
+    }
+
+    if (slot == IPC_RING_MAX_READERS) {
+        percpu_up_read(&chan->ring_rwsem);
+        mutex_unlock(&chan->ring_write_lock);
+        kfree(reader);
+        return -EBUSY; // out of cursor slots
+    }
+
+    reader->slot = slot;
+    smp_store_release(&chan->ring_ctrl->cursors[slot], READ_ONCE(chan->ring_ctrl->head));
+    chan->reader_slots[slot / 64] |= BIT_ULL(slot % 64);
+    WRITE_ONCE(chan->ring_ctrl->readers[slot / 64], chan->reader_slots[slot / 64]);
+    smp_store_release(&f->reader, reader);
+
+    percpu_up_read(&chan->ring_rwsem);
+    mutex_unlock(&chan->ring_write_lock);
+
+    atomic_inc(&chan->open_readers);
+    return 0;
+}
+
+// The file's reader. Files opened read-only get one when they're opened,
+// read-write ones the first time they read, poll for input or ask for their
+// cursor slot: a producer has to open read-write to map the ring writable,
+// and a cursor it never moves would hold the tail back forever.
+// Returns -EINVAL if the file wasn't opened for reading
+static int file_reader(struct file *file, struct ipc_reader **out) {
+    struct ipc_file *f = file->private_data;
+    int retval;
+
+    *out = smp_load_acquire(&f->reader);
+    if (*out) {
+        return 0;
+    }
+    if (!(file->f_mode & FMODE_READ)) {
+        return -EINVAL;
+    }
+
+    retval = reader_attach(f);
+    if (retval) {
+        return retval;
+    }
+    *out = f->reader;
+    return 0;
+}
+
+// Open func
+// The minor number picks the channel. Read-only opens get their cursor slot
+// right away, see file_reader().
+static int device_open(struct inode *inode, struct file *file) {
+    struct ipc_channel *chan = NULL;
+    struct ipc_file *f;
+    int retval;
+
+    mutex_lock(&channels_lock);
+    if (iminor(inode) < IPC_MAX_CHANNELS) {
+        chan = channel_table[iminor(inode)];
+    }
+    if (chan) {
+        kref_get(&chan->ref); // keeps it around until we're closed, even if it gets destroyed
+    }
+    mutex_unlock(&channels_lock);
+
+    if (!chan) {
+        return -ENODEV;
+    }
+
+    this_cpu_inc(chan->stats->userspace_accesses);
+
+    f = kzalloc(sizeof(*f), GFP_KERNEL);
+    if (!f) {
+        retval = -ENOMEM;
+        goto out;
+    }
+    f->chan = chan;
+
+    if ((file->f_mode & FMODE_READ) && !(file->f_mode & FMODE_WRITE)) {
+        retval = reader_attach(f);
+        if (retval) {
+            goto out;
+        }
+    }
+
+    file->private_data = f;
+    trace_ipc_open(chan->minor, f->reader ? f->reader->slot : -1, file->f_flags);
+    return 0;
+
+out:
+    kfree(f);
+    kref_put(&chan->ref, channel_release);
+    return retval;
+}
+
+// Close func
+static int device_closed(struct inode *inode, struct file *file) {
+    struct ipc_file *f = file->private_data;
+    struct ipc_channel *chan = f->chan;
+    struct ipc_reader *reader = f->reader;
+
+    this_cpu_inc(chan->stats->userspace_accesses);
+
+    trace_ipc_release(chan->minor, reader ? reader->slot : -1);
+
+    if (reader) {
+        // Giving the slot back lets writers reclaim whatever it was holding on to
+        mutex_lock(&chan->ring_write_lock);
+        percpu_down_read(&chan->ring_rwsem);
+        chan->reader_slots[reader->slot / 64] &= ~BIT_ULL(reader->slot % 64);
+        WRITE_ONCE(chan->ring_ctrl->readers[reader->slot / 64], chan->reader_slots[reader->slot / 64]);
+        percpu_up_read(&chan->ring_rwsem);
+        mutex_unlock(&chan->ring_write_lock);
+
+        kvfree_sensitive(reader->bounce, reader->bounce_size); // may still hold a decrypted message
+        kvfree_sensitive(reader->inflate, reader->inflate_size);
+        aead_request_free(reader->gcm_req);
+        aead_request_free(reader->chacha_req);
+        kfree(reader);
+        atomic_dec(&chan->open_readers);
+    }
+
+    kfree(f);
+    kref_put(&chan->ref, channel_release); // frees the channel if it was destroyed while we had it open
+    return 0;
+}
+// LATENCY
+// Starting time for a stage, 0 when latency_stats is off
+static u64 lat_start(void) {
+    return latency_stats ? ktime_get_ns() : 0;
+}
+
+static void lat_add(struct ipc_channel *chan, enum ipc_lat_stage stage, u64 ns) {
+    this_cpu_inc(chan->latency->buckets[stage][min_t(int, fls64(ns), LAT_BUCKETS - 1)]);
+}
+
+// Count the time since start (from lat_start) against stage
+static void lat_end(struct ipc_channel *chan, enum ipc_lat_stage stage, u64 start) {
+    if (start) {
+        lat_add(chan, stage, ktime_get_ns() - start);
+    }
+}
+
+// How long the record stamped at stamp sat in the ring
+// Stamps can be scribbled on through the mapping, ones from the future are ignored
+static void lat_queued(struct ipc_channel *chan, u64 stamp) {
+    u64 now;
+
+    if (!latency_stats || !stamp) {
+        return;
+    }
+
+    now = ktime_get_ns();
+    if (now >= stamp) {
+        lat_add(chan, LAT_QUEUE, now - stamp);
+    }
+}
+
+// Grow the channel's encrypted_mem/decrypted_mem to fit a len byte message
+// Caller holds chan->crypto_lock
+static int legacy_scratch_reserve(struct ipc_channel *chan, size_t len) {
+    u16 *enc;
+    u8 *dec;
+
+    if (len <= chan->legacy_scratch_size) {
+        return 0;
+    }
+
+    // kvmalloc falls back to vmalloc for big messages, nothing here needs contiguous pages
+    enc = kvmalloc_array(len, sizeof(*enc), GFP_KERNEL);
+    dec = kvmalloc(len, GFP_KERNEL);
+    if (!enc || !dec) {
+        kvfree(enc);
+        kvfree(dec);
+        return -ENOMEM;
+    }
+
+    kvfree(chan->encrypted_mem);
+    kvfree(chan->decrypted_mem);
+    chan->encrypted_mem = enc;
+    chan->decrypted_mem = dec;
+    chan->legacy_scratch_size = len;
+    return 0;
+}
+
+// RING BUFFER HELPERS
+// Callers hold ring_rwsem, so shm_size and shared_mem can't change underneath us.
+// The control page and record headers can be scribbled on by whoever has the
+// ring mapped, so everything read back from them is treated as untrusted: all
+// offsets are taken modulo shm_size and lengths are checked before use.
+
+// Allocates a zeroed ring with room for size bytes of records
+static char *ring_alloc(size_t size) {
+    char *mem = vmalloc_user(PAGE_SIZE + PAGE_ALIGN(size));
+
+    if (mem) {
+        ((struct ipc_ring_ctrl *)mem)->size = size;
+    }
+    return mem;
+}
+
+// Makes mem the ring that reads and writes go through
+static void ring_install(struct ipc_channel *chan, char *mem) {
+    chan->ring_mem = mem;
+    if (!mem)
+        return;
+
+    chan->ring_ctrl = (struct ipc_ring_ctrl *)mem;
+    chan->shared_mem = mem + PAGE_SIZE;
+    chan->shm_size = chan->ring_ctrl->size;
+
+    // Cursors in a fresh ring all start at 0, which is its head
+    memcpy(chan->ring_ctrl->readers, chan->reader_slots, sizeof(chan->reader_slots));
+    chan->ring_ctrl->retain_messages = chan->retain_messages;
+    chan->ring_ctrl->retain_bytes = chan->retain_bytes;
+}
+
+// Moves everything still queued into mem and makes it the ring.
+// Offsets don't change, only where they land in the data area does, so the
+// head, tail, every reader's cursor, the sequence numbers and the records
+// still waiting for the crypto worker all carry over as they are.
+// Caller holds ring_rwsem for writing.
+// Returns -ENOSPC if what's queued doesn't fit in the new ring
+static int ring_migrate(struct ipc_channel *chan, char *mem) {
+    struct ipc_ring_ctrl *ctrl = (struct ipc_ring_ctrl *)mem;
+    char *data = mem + PAGE_SIZE;
+    u64 head = chan->ring_ctrl->head;
+    u64 end = ring_write_head(chan); // past the worker's pending records, if any
+    u64 tail = chan->ring_ctrl->tail;
+    u64 off;
+
+    // No need to copy what nobody needs, and the retention window only keeps what fits
+    if (end - tail <= chan->shm_size) {
+        tail = ring_reclaim_limit(chan, head, tail, end - tail > ctrl->size ? end - tail - ctrl->size : 0);
+    }
+
+    if (end - tail > chan->shm_size) { // mapping user corrupted the ring, nothing in it can be trusted
+        tail = end = head;
+        chan->ring_reserved = head;
+    }
+
+    if (end - tail > ctrl->size) {
+        return -ENOSPC;
+    }
+
+    // Copy in pieces that don't wrap in either ring
+    for (off = tail; off != end; ) {
+        size_t from = off % chan->shm_size;
+        size_t to = off % ctrl->size;
+        size_t n = min3((size_t)(end - off), chan->shm_size - from, (size_t)ctrl->size - to);
+
+        memcpy(data + to, chan->shared_mem + from, n);
+        off += n;
+    }
+
+    ctrl->head = head;
+    ctrl->tail = tail;
+    ctrl->seq = chan->ring_ctrl->seq;
+    memcpy(ctrl->cursors, chan->ring_ctrl->cursors, sizeof(ctrl->cursors));
+
+    vfree(chan->ring_mem);
+    ring_install(chan, mem);
+    return 0;
+}
+
+// IOCTL_SET_SHM_SIZE
+// Swaps in a ring with room for size bytes of records, queued messages come
+// along. Readers and writers are held off only while they're copied over.
+static int ring_resize(struct ipc_channel *chan, int size) {
+    char *new_mem;
+    int retval;
+
+    // All the various error numbers: ( a lot )
+    // https://www.man7.org/linux/man-pages/man3/errno.3.html
+    if (size < (int)RECORD_SIZE(1) || size > RING_MAX_SIZE) {
+        return -EINVAL;
+    }
+
+    new_mem = ring_alloc(round_down(size, RECORD_ALIGN)); // keeps offsets aligned
+    if (!new_mem) {
+        return -ENOMEM;
+    }
+
+    // Waits until no reader or writer is inside the ring
+    percpu_down_write(&chan->ring_rwsem);
+
+    // A process that has the ring mapped would be left looking at freed pages
+    if (atomic_read(&chan->ring_mappings) > 0) {
+        retval = -EBUSY;
+    } else {
+        retval = ring_migrate(chan, new_mem);
+    }
+
+    percpu_up_write(&chan->ring_rwsem);
+
+    if (retval) {
+        vfree(new_mem);
+        return retval;
+    }
+
+    ring_notify(chan); // sleepers re-check against the new ring, writers may have room now
+    return 0;
+}
+
+// Where the tail could move up to: the cursor of the slowest reader, or the
+// head if nobody is reading. Cursors that aren't between tail and head have
+// been scribbled on through the mapping and are ignored.
+static u64 ring_slowest_reader(struct ipc_channel *chan, u64 head, u64 tail) {
+    u64 new_tail = head;
+
+    for (int i = 0; i < IPC_RING_MAX_READERS / 64; i++) {
+        u64 word = READ_ONCE(chan->reader_slots[i]);
+
+        while (word) {
+            int slot = i * 64 + __ffs64(word);
+            u64 cursor = smp_load_acquire(&chan->ring_ctrl->cursors[slot]);
+
+            if (cursor - tail <= head - tail && cursor - tail < new_tail - tail)
+                new_tail = cursor;
+            word &= word - 1;
+        }
+    }
+
+    return new_tail;
+}
+
+// Where the tail can move up to: past everything every reader is done with,
+// but not into the retention window, unless the window has to give up its
+// oldest records to free need bytes past the tail (retention is best effort,
+// only readers hold writers up). Finding where the window starts means
+// walking the records, but only the ones about to be released, so each
+// record gets looked at about once.
+static u64 ring_reclaim_limit(struct ipc_channel *chan, u64 head, u64 tail, u64 need) {
+    u64 limit = ring_slowest_reader(chan, head, tail);
+    u32 keep_messages = READ_ONCE(chan->retain_messages);
+    u32 keep_bytes = READ_ONCE(chan->retain_bytes);
+    u64 seq = READ_ONCE(chan->ring_ctrl->seq);
+    u64 pos;
+
+    if ((!keep_messages && !keep_bytes) || head - tail > chan->shm_size) {
+        return limit;
+    }
+
+    for (pos = tail; pos != limit; ) {
+        struct ipc_record_hdr hdr;
+
+        ring_copy_out(chan, &hdr, pos, sizeof(hdr));
+        if (RECORD_SIZE(hdr.len) > limit - pos) { // mapping user corrupted the ring, nothing to keep
+            return limit;
+        }
+        if (pos - tail >= need && (seq - hdr.seq <= keep_messages || head - pos <= keep_bytes)) {
+            break;
+        }
+        pos += RECORD_SIZE(hdr.len);
+    }
+    return pos;
+}
+
+// Where the next record goes: after the records still waiting for the crypto
+// worker, if there are any. An mmap producer may have pushed past those, in
+// which case ring_reserved is stale and the head wins.
+static u64 ring_write_head(struct ipc_channel *chan) {
+    u64 head = smp_load_acquire(&chan->ring_ctrl->head);
+    u64 reserved = smp_load_acquire(&chan->ring_reserved);
+
+    return reserved - head <= chan->shm_size ? reserved : head;
+}
+
+// Copy len bytes out of the ring starting at off, wrapping around the end
+static void ring_copy_out(struct ipc_channel *chan, void *dst, u64 off, size_t len) {
+    size_t pos = off % chan->shm_size;
+    size_t first = min(len, chan->shm_size - pos);
+
+    memcpy(dst, chan->shared_mem + pos, first);
+    memcpy((char *)dst + first, chan->shared_mem, len - first);
+}
+
+// Zero len bytes of the ring starting at off
+static void ring_clear(struct ipc_channel *chan, u64 off, size_t len) {
+    size_t pos = off % chan->shm_size;
+    size_t first = min(len, chan->shm_size - pos);
+
+    memset(chan->shared_mem + pos, 0, first);
+    memset(chan->shared_mem, 0, len - first);
+}
+
+// Copy len bytes into the ring starting at off
+static void ring_copy_in(struct ipc_channel *chan, u64 off, const void *src, size_t len) {
+    size_t pos = off % chan->shm_size;
+    size_t first = min(len, chan->shm_size - pos);
+
+    memcpy(chan->shared_mem + pos, src, first);
+    memcpy(chan->shared_mem, (const char *)src + first, len - first);
+}
+
+// Payload length of the record at off
+static u32 ring_record_len(struct ipc_channel *chan, u64 off) {
+    struct ipc_record_hdr hdr;
+
+    ring_copy_out(chan, &hdr, off, sizeof(hdr));
+    return hdr.len;
+}
+
+// Length of the message in the record at off as read() hands it out: the
+// real length for a compressed record, the stored one (an upper bound for
+// AEAD records) otherwise
+static u32 ring_message_len(struct ipc_channel *chan, u64 off) {
+    struct ipc_record_hdr hdr;
+    u32 len;
+
+    ring_copy_out(chan, &hdr, off, sizeof(hdr));
+    if (!(hdr.flags & IPC_RECORD_LZ4) || hdr.len < IPC_LZ4_PREFIX) {
+        return hdr.len;
+    }
+
+    ring_copy_out(chan, &len, off + sizeof(hdr), sizeof(len));
+    return len;
+}
+
+// Wake up blocked readers and pollers so they look at the ring again
+static void ring_notify(struct ipc_channel *chan) {
+    atomic_inc(&chan->ring_events);
+    wake_up_interruptible(&chan->ring_readable);
+    wake_up_interruptible(&chan->ring_writable);
+}
+
+// Same as ring_copy_out but straight into userspace
+static int ring_copy_to_user(struct ipc_channel *chan, char __user *dst, u64 off, size_t len) {
+    size_t pos = off % chan->shm_size;
+    size_t first = min(len, chan->shm_size - pos);
+
+    if (copy_to_user(dst, chan->shared_mem + pos, first))
+        return -EFAULT;
+    if (copy_to_user(dst + first, chan->shared_mem, len - first))
+        return -EFAULT;
+    return 0;
+}
+
+// Copy len bytes from userspace into the ring starting at off
+static int ring_copy_from_user(struct ipc_channel *chan, u64 off, const char __user *src, size_t len) {
+    size_t pos = off % chan->shm_size;
+    size_t first = min(len, chan->shm_size - pos);
+
+    if (copy_from_user(chan->shared_mem + pos, src, first))
+        return -EFAULT;
+    if (copy_from_user(chan->shared_mem, src + first, len - first))
+        return -EFAULT;
+    return 0;
+}
+
+// MMAP
+// The whole ring (control page + data pages) is mapped from offset 0, see
+// ipc_ring.h for how userspace pushes and pops records through it.
+
+// The mapping holds the file, and with it the channel and the module, until
+// it's gone. The kernel calls ring_vm_close() before it lets go of the file,
+// so this code is still loaded when it runs.
+static void ring_vm_open(struct vm_area_struct *vma) {
+    struct ipc_channel *chan = vma->vm_private_data;
+
+    atomic_inc(&chan->ring_mappings); // fork or a split of an existing mapping
+}
+
+static void ring_vm_close(struct vm_area_struct *vma) {
+    struct ipc_channel *chan = vma->vm_private_data;
+
+    atomic_dec(&chan->ring_mappings);
+}
+
+static const struct vm_operations_struct ring_vm_ops = {
+    .open = ring_vm_open,
+    .close = ring_vm_close,
+};
+
+static int device_mmap(struct file *file, struct vm_area_struct *vma) {
+    struct ipc_file *f = file->private_data;
+    struct ipc_channel *chan = f->chan;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    int retval;
+
+    if (vma->vm_pgoff != 0) {
+        return -EINVAL;
+    }
+
+    percpu_down_read(&chan->ring_rwsem); // stops the ring being resized while we map it
+
+    if (len > PAGE_SIZE + PAGE_ALIGN(chan->shm_size)) {
+        percpu_up_read(&chan->ring_rwsem);
+        return -EINVAL;
+    }
+
+    retval = remap_vmalloc_range(vma, chan->ring_mem, 0);
+    if (retval == 0) {
+        vma->vm_ops = &ring_vm_ops;
+        vma->vm_private_data = chan;
+        atomic_inc(&chan->ring_mappings); // vm_ops->open isn't called for the first mapping
+    }
+
+    percpu_up_read(&chan->ring_rwsem);
+    return retval;
+}
+
+// POLL
+// Readable while there's a record this reader hasn't seen, writable while at
+// least the smallest record still fits.
+static __poll_t device_poll(struct file *file, poll_table *wait) {
+    struct ipc_file *f = file->private_data;
+    struct ipc_channel *chan = f->chan;
+    struct ipc_reader *reader = NULL;
+    __poll_t mask = 0;
+    u64 head, tail;
+
+    // Only waiting for room doesn't make a read-write file a reader
+    if (poll_requested_events(wait) & (EPOLLIN | EPOLLRDNORM)) {
+        file_reader(file, &reader); // no cursor slot left, it just never becomes readable
+    }
+
+    poll_wait(file, &chan->ring_readable, wait);
+    poll_wait(file, &chan->ring_writable, wait);
+
+    percpu_down_read(&chan->ring_rwsem);
+
+    head = smp_load_acquire(&chan->ring_ctrl->head);
+    tail = ring_slowest_reader(chan, head, smp_load_acquire(&chan->ring_ctrl->tail)); // a write can push out retained records
+
+    if (reader && head != READ_ONCE(chan->ring_ctrl->cursors[reader->slot])) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (ring_write_head(chan) - tail <= chan->shm_size - RECORD_SIZE(1)) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+
+    percpu_up_read(&chan->ring_rwsem);
+    return mask;
+}
+
+// AEAD ENCRYPTION
+// Grow a bounce buffer to at least need bytes, the old one may hold plaintext
+// Messages can be as big as the ring (RING_MAX_SIZE), well past what kmalloc
+// hands out, so big ones come from vmalloc; see aead_sg() for what that means
+// for the ciphers.
+static int bounce_reserve(char **buf, size_t *size, size_t need) {
+    char *bigger;
+
+    if (need <= *size) {
+        return 0;
+    }
+
+    bigger = kvmalloc(need, GFP_KERNEL);
+    if (!bigger) {
+        return -ENOMEM;
+    }
+
+    kvfree_sensitive(*buf, *size);
+    *buf = bigger;
+    *size = need;
+    return 0;
+}
+
+// Scatterlist for len bytes at buf. sg_init_one() only works for memory
+// from kmalloc, a vmalloc'd bounce buffer has to be described a page at a
+// time, in table (freed by the caller with sg_free_table()).
+static int aead_sg(struct scatterlist *one, struct sg_table *table, char *buf, size_t len, struct scatterlist **out) {
+    struct scatterlist *sg;
+    unsigned int nents, i;
+    int retval;
+
+    if (!is_vmalloc_addr(buf)) {
+        sg_init_one(one, buf, len);
+        *out = one;
+        return 0;
+    }
+
+    nents = DIV_ROUND_UP(offset_in_page(buf) + len, PAGE_SIZE);
+    retval = sg_alloc_table(table, nents, GFP_KERNEL);
+    if (retval) {
+        return retval;
+    }
+
+    for_each_sg(table->sgl, sg, nents, i) {
+        size_t n = min_t(size_t, len, PAGE_SIZE - offset_in_page(buf));
+
+        sg_set_page(sg, vmalloc_to_page(buf), n, offset_in_page(buf));
+        buf += n;
+        len -= n;
+    }
+    *out = table->sgl;
+    return 0;
+}
+
+// Encrypt or decrypt buf in place with req, a request for the cipher's
+// transform. cryptlen is the plaintext length when encrypting (the tag gets
+// appended after it) and plaintext + tag when decrypting.
+// Returns 0, or -EBADMSG if the tag doesn't match.
+static int aead_crypt(struct aead_request *req, char *buf, size_t cryptlen, u8 *nonce, bool encrypt) {
+    struct sg_table table = { 0 };
+    struct scatterlist one, *sg;
+    DECLARE_CRYPTO_WAIT(wait);
+    int retval;
+
+    retval = aead_sg(&one, &table, buf, cryptlen + (encrypt ? AEAD_TAG_SIZE : 0), &sg);
+    if (retval) {
+        return retval;
+    }
+
+    aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP, crypto_req_done, &wait);
+    aead_request_set_crypt(req, sg, sg, cryptlen, nonce);
+    aead_request_set_ad(req, 0);
+
+    retval = crypto_wait_req(encrypt ? crypto_aead_encrypt(req) : crypto_aead_decrypt(req), &wait);
+
+    sg_free_table(&table); // nothing to free if it was one piece
+    return retval;
+}
+
+// Transform for an IPC_CIPHER_* value, NULL if it isn't an available AEAD
+static struct crypto_aead *aead_tfm(struct ipc_channel *chan, u32 cipher) {
+    if (cipher == IPC_CIPHER_AES_GCM)
+        return chan->gcm_tfm;
+    if (cipher == IPC_CIPHER_CHACHA20_POLY1305)
+        return chan->chacha_tfm;
+    return NULL;
+}
+
+// Turn buf, which holds the len byte plaintext after AEAD_NONCE_SIZE bytes of
+// room, into nonce | ciphertext | tag. Callers are serialized (write() by
+// ring_write_lock, the worker by being the only one), which keeps the nonce
+// counter unique.
+static int aead_seal(struct ipc_channel *chan, u32 cipher, char *buf, size_t len) {
+    u64 start = trace_ipc_encrypt_enabled() ? ktime_get_ns() : lat_start();
+    u8 nonce[AEAD_NONCE_SIZE];
+    int retval;
+
+    // 4 random bytes per key + a counter, a nonce is never reused under the same key
+    memcpy(nonce, chan->nonce_salt, sizeof(chan->nonce_salt));
+    memcpy(nonce + sizeof(chan->nonce_salt), &chan->nonce_counter, sizeof(chan->nonce_counter));
+    chan->nonce_counter++;
+
+    memcpy(buf, nonce, AEAD_NONCE_SIZE);
+    retval = aead_crypt(cipher == IPC_CIPHER_AES_GCM ? chan->gcm_req : chan->chacha_req,
+                        buf + AEAD_NONCE_SIZE, len, nonce, true);
+
+    if (start) {
+        u64 ns = ktime_get_ns() - start;
+
+        trace_ipc_encrypt(cipher, len, ns, retval);
+        if (latency_stats)
+            lat_add(chan, LAT_ENCRYPT, ns);
+    }
+    return retval;
+}
+
+// Build the stored form of a len byte message in write_bounce
+// Caller holds ring_write_lock
+static int aead_encrypt_from_user(struct ipc_channel *chan, const char __user *src, size_t len) {
+    int retval;
+
+    retval = bounce_reserve(&chan->write_bounce, &chan->write_bounce_size, len + AEAD_OVERHEAD);
+    if (retval) {
+        return retval;
+    }
+
+    if (copy_from_user(chan->write_bounce + AEAD_NONCE_SIZE, src, len)) {
+        return -EFAULT;
+    }
+
+    return aead_seal(chan, chan->cipher_mode, chan->write_bounce, len);
+}
+
+// Decrypt the stored_len byte record payload at off into reader->bounce
+// Returns the plaintext length, or -EBADMSG if the record was written under
+// another key, has been tampered with or the cipher isn't available
+static ssize_t aead_decrypt_record(struct ipc_channel *chan, struct ipc_reader *reader, u64 off, u32 stored_len, u32 cipher) {
+    struct crypto_aead *tfm = aead_tfm(chan, cipher);
+    struct aead_request **req = cipher == IPC_CIPHER_AES_GCM ? &reader->gcm_req : &reader->chacha_req;
+    u8 nonce[AEAD_NONCE_SIZE];
+    u64 start;
+    int retval;
+
+    if (!tfm || stored_len < AEAD_OVERHEAD) {
+        return -EBADMSG;
+    }
+
+    // Kept for the reader's next record, the transforms live as long as the channel
+    if (!*req) {
+        *req = aead_request_alloc(tfm, GFP_KERNEL);
+        if (!*req) {
+            return -ENOMEM;
+        }
+    }
+
+    retval = bounce_reserve(&reader->bounce, &reader->bounce_size, stored_len);
+    if (retval) {
+        return retval;
+    }
+
+    ring_copy_out(chan, nonce, off, AEAD_NONCE_SIZE);
+    ring_copy_out(chan, reader->bounce, off + AEAD_NONCE_SIZE, stored_len - AEAD_NONCE_SIZE);
+
+    start = trace_ipc_decrypt_enabled() ? ktime_get_ns() : lat_start();
+    retval = aead_crypt(*req, reader->bounce, stored_len - AEAD_NONCE_SIZE, nonce, false);
+    if (start) {
+        u64 ns = ktime_get_ns() - start;
+
+        trace_ipc_decrypt(cipher, stored_len - AEAD_OVERHEAD, ns, retval);
+        if (latency_stats)
+            lat_add(chan, LAT_DECRYPT, ns);
+    }
+    if (retval) {
+        return retval == -ENOMEM ? retval : -EBADMSG;
+    }
+
+    return stored_len - AEAD_OVERHEAD;
+}
+
+// LZ4 COMPRESSION
+// https://docs.kernel.org/staging/lz4.html
+#define LZ4_MAX_RATIO 255 // an LZ4 block never expands to more than this many times its size
+// IOCTL_SET_COMPRESS
+// Messages already in the ring stay the way they were written
+static long lz4_set_mode(struct ipc_channel *chan, int mode) {
+    void *wrkmem = NULL;
+
+    if (mode != IPC_COMPRESS_NONE && mode != IPC_COMPRESS_LZ4) {
+        return -EINVAL;
+    }
+
+    if (mode == IPC_COMPRESS_LZ4) {
+        wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+        if (!wrkmem) {
+            return -ENOMEM;
+        }
+    }
+
+    if (mutex_lock_interruptible(&chan->ring_write_lock)) {
+        kvfree(wrkmem);
+        return -EINTR;
+    }
+    swap(chan->lz4_wrkmem, wrkmem);
+    chan->compress_mode = mode;
+    mutex_unlock(&chan->ring_write_lock);
+
+    kvfree(wrkmem); // the old one, if any
+    return 0;
+}
+
+// Compress the len byte message at src into write_bounce, after
+// AEAD_NONCE_SIZE bytes of room so aead_seal() can encrypt it where it is.
+// Returns the compressed length, 0 if that wouldn't save anything or there's
+// no memory to do it with (the message gets stored as written), or an error.
+// Caller holds ring_write_lock
+static ssize_t lz4_compress_from_user(struct ipc_channel *chan, const char __user *src, size_t len) {
+    int bound, out;
+    u64 start;
+    int retval;
+
+    if (len > RING_MAX_SIZE) { // couldn't be read back, see lz4_inflate_record()
+        return 0;
+    }
+    bound = LZ4_compressBound(len);
+
+    retval = bounce_reserve(&chan->compress_src, &chan->compress_src_size, len);
+    if (!retval) {
+        retval = bounce_reserve(&chan->write_bounce, &chan->write_bounce_size, AEAD_OVERHEAD + bound);
+    }
+    if (retval) {
+        return 0;
+    }
+
+    if (copy_from_user(chan->compress_src, src, len)) {
+        return -EFAULT;
+    }
+
+    start = ktime_get_ns();
+    out = LZ4_compress_default(chan->compress_src, chan->write_bounce + AEAD_NONCE_SIZE, len, bound, chan->lz4_wrkmem);
+
+    this_cpu_add(chan->stats->compress_ns, ktime_get_ns() - start);
+    if (out <= 0 || out + IPC_LZ4_PREFIX >= len) {
+        out = 0;
+    }
+
+    return out; // what it saved gets counted by stats_written(), once the record is in
+}
+
+// Decompress the compressed record at pos into reader->inflate, decrypting it
+// first if it was stored encrypted
+// Returns the message length, or -EBADMSG if the record is corrupt or can't
+// be decrypted. The length prefix can be forged through the mapping, so one
+// LZ4 couldn't have produced from a block that size is refused before
+// anything gets allocated for it.
+static ssize_t lz4_inflate_record(struct ipc_channel *chan, struct ipc_reader *reader, u64 pos, const struct ipc_record_hdr *hdr) {
+    u32 cipher = hdr->flags & IPC_CIPHER_MASK;
+    u64 body = pos + sizeof(*hdr) + IPC_LZ4_PREFIX;
+    ssize_t body_len;
+    u32 orig_len;
+    u64 start;
+    int retval;
+
+    if (hdr->len < IPC_LZ4_PREFIX) {
+        return -EBADMSG;
+    }
+
+    body_len = hdr->len - IPC_LZ4_PREFIX;
+    ring_copy_out(chan, &orig_len, pos + sizeof(*hdr), sizeof(orig_len));
+    if (orig_len == 0 || orig_len > RING_MAX_SIZE || orig_len > (u64)body_len * LZ4_MAX_RATIO) {
+        return -EBADMSG;
+    }
+
+    if (cipher == IPC_CIPHER_AES_GCM || cipher == IPC_CIPHER_CHACHA20_POLY1305) {
+        body_len = aead_decrypt_record(chan, reader, body, body_len, cipher);
+        if (body_len < 0) {
+            return body_len;
+        }
+    } else {
+        // LZ4 wants it in one piece, it may wrap around the end of the ring
+        retval = bounce_reserve(&reader->bounce, &reader->bounce_size, body_len);
+        if (retval) {
+            return retval;
+        }
+        ring_copy_out(chan, reader->bounce, body, body_len);
+    }
+
+    retval = bounce_reserve(&reader->inflate, &reader->inflate_size, orig_len);
+    if (retval) {
+        return retval;
+    }
+
+    start = ktime_get_ns();
+    retval = LZ4_decompress_safe(reader->bounce, reader->inflate, body_len, orig_len);
+    this_cpu_add(chan->stats->decompress_ns, ktime_get_ns() - start);
+
+    if (retval != orig_len) {
+        return -EBADMSG;
+    }
+    return orig_len;
+}
+
+// IOCTL_SET_KEY
+// Messages already in the ring keep the cipher they were written with.
+// Records from before an AEAD key change can't be decrypted any more and get
+// skipped by readers.
+static long crypto_set_key(struct ipc_channel *chan, struct ipc_key __user *user_key) {
+    struct crypto_aead *tfm = NULL;
+    struct ipc_key key;
+    long retval = 0;
+
+    if (copy_from_user(&key, user_key, sizeof(key))) {
+        return -EFAULT;
+    }
+
+    switch (key.cipher) {
+        case IPC_CIPHER_NONE:
+        case IPC_CIPHER_LEGACY:
+            break;
+        case IPC_CIPHER_AES_GCM:
+            tfm = chan->gcm_tfm;
+            if (!tfm) {
+                retval = -EOPNOTSUPP; // the kernel doesn't have this cipher
+                goto out;
+            }
+            if (key.key_len != 16 && key.key_len != 24 && key.key_len != 32) {
+                retval = -EINVAL; // checked before the transform sees it, see below
+                goto out;
+            }
+            break;
+        case IPC_CIPHER_CHACHA20_POLY1305:
+            tfm = chan->chacha_tfm;
+            if (!tfm) {
+                retval = -EOPNOTSUPP;
+                goto out;
+            }
+            if (key.key_len != 32) {
+                retval = -EINVAL;
+                goto out;
+            }
+            break;
+        default:
+            retval = -EINVAL;
+            goto out;
+    }
+
+    if (key.key_len > IPC_KEY_MAX) {
+        retval = -EINVAL;
+        goto out;
+    }
+
+    // Keep everyone out while the key changes underneath the transform
+    percpu_down_write(&chan->ring_rwsem);
+
+    // A failed setkey leaves the transform without a key, so if the channel
+    // was using it, it goes back to plaintext rather than failing every write
+    if (tfm) {
+        retval = crypto_aead_setauthsize(tfm, AEAD_TAG_SIZE);
+        if (!retval) {
+            retval = crypto_aead_setkey(tfm, key.key, key.key_len);
+        }
+        if (retval && chan->cipher_tfm == tfm) {
+            printk(KERN_WARNING "Setting the key failed, channel %d stores messages unencrypted now\n", chan->minor);
+            chan->cipher_mode = IPC_CIPHER_NONE;
+            chan->cipher_tfm = NULL;
+        }
+    }
+
+    if (!retval) {
+        chan->cipher_mode = key.cipher;
+        chan->cipher_tfm = tfm;
+        get_random_bytes(chan->nonce_salt, sizeof(chan->nonce_salt));
+        get_random_bytes(&chan->nonce_counter, sizeof(chan->nonce_counter));
+        printk(KERN_INFO "Cipher set to %u\n", key.cipher);
+    }
+
+    percpu_up_write(&chan->ring_rwsem);
+
+out:
+    memzero_explicit(&key, sizeof(key)); // don't leave the key on the stack
+    return retval;
+}
+
+// Copies the record at pos out to userspace, decrypting and decompressing it
+// first if it was stored that way. Framed readers get a header (with the plaintext length)
+// and padding around the payload, see IPC_READ_FRAMED.
+// Returns the bytes put in dst, -EMSGSIZE if that would take more than room,
+// -EBADMSG for a record that can't be decrypted, or -ENOMEM if there's no
+// memory to unpack it (callers skip both).
+static ssize_t ring_deliver_record(struct ipc_channel *chan, struct ipc_reader *reader, u64 pos, const struct ipc_record_hdr *hdr,
+                                   char __user *dst, size_t room, bool framed) {
+    struct ipc_record_hdr out_hdr = { .len = hdr->len, .flags = IPC_CIPHER_NONE, .stamp = hdr->stamp, .seq = hdr->seq };
+    const char *plain = NULL; // decrypted payload, NULL if it can go straight from the ring
+    ssize_t len = hdr->len;
+    size_t needed;
+    u64 start;
+
+    if (hdr->flags & IPC_RECORD_LZ4) {
+        // Make sure it fits before going to the trouble of decompressing it
+        len = ring_message_len(chan, pos);
+        if ((framed ? RECORD_SIZE(len) : len) > room) {
+            return -EMSGSIZE;
+        }
+        len = lz4_inflate_record(chan, reader, pos, hdr);
+        if (len < 0) {
+            return len;
+        }
+        plain = reader->inflate;
+        out_hdr.len = len;
+    } else if (hdr->flags == IPC_CIPHER_AES_GCM || hdr->flags == IPC_CIPHER_CHACHA20_POLY1305) {
+        len = aead_decrypt_record(chan, reader, pos + sizeof(*hdr), hdr->len, hdr->flags);
+        if (len < 0) {
+            return len;
+        }
+        plain = reader->bounce;
+        out_hdr.len = len;
+    }
+
+    needed = framed ? RECORD_SIZE(len) : len;
+    if (needed > room) {
+        return -EMSGSIZE;
+    }
+
+    start = lat_start();
+
+    if (framed) {
+        if (copy_to_user(dst, &out_hdr, sizeof(out_hdr)))
+            return -EFAULT;
+        dst += sizeof(out_hdr);
+    }
+
+    if (plain ? copy_to_user(dst, plain, len) : ring_copy_to_user(chan, dst, pos + sizeof(*hdr), len)) {
+        printk(KERN_ERR "Failed to copy data to user space\n");
+        return -EFAULT;
+    }
+
+    if (framed && clear_user(dst + len, needed - sizeof(out_hdr) - len)) {
+        return -EFAULT;
+    }
+
+    lat_end(chan, LAT_COPY_OUT, start);
+    lat_queued(chan, hdr->stamp);
+
+    return needed;
+}
+
+// Framed read
+// Copies as many whole records as fit in len and moves the cursor past them.
+// Records that aren't AEAD encrypted or compressed go out exactly as they sit
+// in the ring (header, payload, padding); they're contiguous, so a run of them
+// goes out in one copy (two if it wraps around the end). AEAD and compressed
+// records are unpacked one at a time, and skipped if that fails.
+static ssize_t ring_read_framed(struct ipc_channel *chan, struct ipc_reader *reader, char __user *user_buffer, size_t len, u64 head, u64 cursor) {
+    u64 run = cursor; // start of the run of plaintext records not copied out yet
+    u64 pos = cursor;
+    size_t out = 0;
+    u32 records = 0; // delivered, for the tracepoint
+    ssize_t retval;
+
+    while (pos != head) {
+        struct ipc_record_hdr hdr;
+        bool packed;
+
+        ring_copy_out(chan, &hdr, pos, sizeof(hdr));
+        if (RECORD_SIZE(hdr.len) > head - pos) { // mapping user corrupted the ring
+            break;
+        }
+
+        packed = hdr.flags == IPC_CIPHER_AES_GCM || hdr.flags == IPC_CIPHER_CHACHA20_POLY1305 ||
+                 (hdr.flags & IPC_RECORD_LZ4);
+        if (!packed) {
+            if (out + (pos - run) + RECORD_SIZE(hdr.len) > len) { // out of room
+                break;
+            }
+
+            lat_queued(chan, hdr.stamp);
+            pos += RECORD_SIZE(hdr.len);
+            records++;
+            continue;
+        }
+
+        // Flush the run before the AEAD or compressed record
+        if (pos != run) {
+            u64 start = lat_start();
+
+            if (ring_copy_to_user(chan, user_buffer + out, run, pos - run)) {
+                printk(KERN_ERR "Failed to copy data to user space\n");
+                return -EFAULT;
+            }
+            lat_end(chan, LAT_COPY_OUT, start);
+            out += pos - run;
+        }
+
+        retval = ring_deliver_record(chan, reader, pos, &hdr, user_buffer + out, len - out, true);
+        if (retval == -EFAULT) {
+            return retval;
+        }
+        if (retval == -ENOMEM) { // skipped like an undecryptable one, it'd never get any smaller
+            printk_ratelimited(KERN_WARNING "No memory to unpack a %u byte record, skipped it\n", hdr.len);
+        }
+        if (retval == -EMSGSIZE) { // out of room
+            run = pos;
+            break;
+        }
+
+        if (retval > 0) {
+            out += retval;
+            records++;
+        }
+        pos += RECORD_SIZE(hdr.len);
+        run = pos;
+    }
+
+    if (pos != run) {
+        u64 start = lat_start();
+
+        if (ring_copy_to_user(chan, user_buffer + out, run, pos - run)) {
+            printk(KERN_ERR "Failed to copy data to user space\n");
+            return -EFAULT;
+        }
+        lat_end(chan, LAT_COPY_OUT, start);
+        out += pos - run;
+    }
+
+    if (pos == cursor) { // not even the first record fits
+        return -EMSGSIZE;
+    }
+
+    smp_store_release(&chan->ring_ctrl->cursors[reader->slot], pos);
+    wake_up_interruptible(&chan->ring_writable);
+
+    if (out == 0) { // everything we got to was undecryptable
+        return -EBADMSG;
+    }
+
+    trace_ipc_dequeue(chan->minor, reader->slot, cursor, records, out);
+
+    return out;
+}
+
+// Read
+// Hands out the next record this reader hasn't seen and moves its cursor
+// past it, other readers still get their own copy. A buffer too small for the
+// record gets -EMSGSIZE and the cursor stays put, the caller can ask for the
+// record's length with IOCTL_GET_CURRENT_BUFFER_SIZE.
+// Readers in IPC_READ_FRAMED mode get as many records as fit instead, see
+// ring_read_framed().
+// Blocks until a record shows up unless the file was opened with O_NONBLOCK.
+static ssize_t device_read(struct file *file, char __user *user_buffer, size_t len, loff_t *offset) {
+    struct ipc_file *f = file->private_data;
+    struct ipc_channel *chan = f->chan;
+    struct ipc_reader *reader;
+    struct ipc_record_hdr hdr;
+    ssize_t bytes_to_read;
+    u64 head, tail, cursor;
+    int events;
+
+    //update proc file stats, the read itself is only counted once it hands something out
+    this_cpu_inc(chan->stats->userspace_accesses);
+
+    bytes_to_read = file_reader(file, &reader);
+    if (bytes_to_read) {
+        return bytes_to_read;
+    }
+
+    while (1) {
+        if (mutex_lock_interruptible(&reader->lock)) { // only against threads sharing this file
+            return -EINTR;
+        }
+        percpu_down_read(&chan->ring_rwsem); // keeps the ring from being resized under us
+
+        events = atomic_read(&chan->ring_events); // taken before looking, so a push after this wakes us
+        smp_rmb();
+        head = smp_load_acquire(&chan->ring_ctrl->head); // an mmap producer may be pushing concurrently
+        tail = smp_load_acquire(&chan->ring_ctrl->tail);
+        cursor = READ_ONCE(chan->ring_ctrl->cursors[reader->slot]);
+
+        if (head != cursor) { // check for data
+            break;
+        }
+
+        percpu_up_read(&chan->ring_rwsem);
+        mutex_unlock(&reader->lock);
+
+        if (file->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+
+        if (wait_event_interruptible(chan->ring_readable, atomic_read(&chan->ring_events) != events)) {
+            return -ERESTARTSYS; // interrupted by a signal
+        }
+    }
+
+    if (head - tail > chan->shm_size) { // mapping user corrupted the ring
+        bytes_to_read = -EIO;
+        goto out;
+    }
+
+    if (cursor - tail > head - tail) { // cursor was scribbled on through the mapping, start over from the oldest record
+        cursor = tail;
+        smp_store_release(&chan->ring_ctrl->cursors[reader->slot], cursor);
+    }
+
+    ring_copy_out(chan, &hdr, cursor, sizeof(hdr));
+
+    if (RECORD_SIZE(hdr.len) > head - cursor) { // mapping user corrupted the ring
+        bytes_to_read = -EIO;
+        goto out;
+    }
+
+    if (reader->read_mode == IPC_READ_FRAMED) {
+        bytes_to_read = ring_read_framed(chan, reader, user_buffer, len, head, cursor);
+        goto out;
+    }
+
+    bytes_to_read = ring_deliver_record(chan, reader, cursor, &hdr, user_buffer, len, false);
+    if (bytes_to_read == -EFAULT || bytes_to_read == -EMSGSIZE) {
+        goto out; // cursor stays put so the caller can retry
+    }
+    if (bytes_to_read == -ENOMEM) {
+        printk_ratelimited(KERN_WARNING "No memory to unpack a %u byte record, skipped it\n", hdr.len);
+    }
+
+    // Done with the record (or it can't be delivered and retrying won't help),
+    // once every reader is past it writers can reuse the space
+    smp_store_release(&chan->ring_ctrl->cursors[reader->slot], cursor + RECORD_SIZE(hdr.len));
+    wake_up_interruptible(&chan->ring_writable);
+
+    trace_ipc_dequeue(chan->minor, reader->slot, cursor, 1, bytes_to_read < 0 ? 0 : bytes_to_read);
+
+out:
+    percpu_up_read(&chan->ring_rwsem);
+    mutex_unlock(&reader->lock);  // to ensure its released or else it gets stuck
+
+    if (bytes_to_read > 0) {
+        this_cpu_inc(chan->stats->reads_count);
+        this_cpu_add(chan->stats->total_bytes_read, bytes_to_read);
+    }
+
+    return bytes_to_read;
+}
+
+// Seek (IOCTL_SEEK_SEQ)
+// Walks the records from the tail to the one numbered *user_seq and puts the
+// reader's cursor there, see ipc_ring.h for what happens when it's gone or
+// not written yet. That's a walk over everything kept, but it's done once when
+// a reader starts, not per message, so no index is kept for it. Holding the
+// write lock stops the tail moving past the records while we look.
+static long ring_seek(struct ipc_channel *chan, struct ipc_reader *reader, u64 __user *user_seq) {
+    struct ipc_record_hdr hdr;
+    u64 wanted, seq, head, pos;
+    long retval = 0;
+
+    if (copy_from_user(&wanted, user_seq, sizeof(wanted))) {
+        return -EFAULT;
+    }
+
+    if (mutex_lock_interruptible(&reader->lock)) {
+        return -EINTR;
+    }
+    if (mutex_lock_interruptible(&chan->ring_write_lock)) {
+        mutex_unlock(&reader->lock);
+        return -EINTR;
+    }
+    percpu_down_read(&chan->ring_rwsem);
+
+    head = smp_load_acquire(&chan->ring_ctrl->head);
+    pos = READ_ONCE(chan->ring_ctrl->tail);
+
+    if (head - pos > chan->shm_size) { // mapping user corrupted the ring
+        retval = -EIO;
+        goto out;
+    }
+
+    for (; pos != head; pos += RECORD_SIZE(hdr.len)) {
+        ring_copy_out(chan, &hdr, pos, sizeof(hdr));
+        if (RECORD_SIZE(hdr.len) > head - pos) { // mapping user corrupted the ring
+            retval = -EIO;
+            goto out;
+        }
+        if (hdr.seq >= wanted) {
+            break;
+        }
+    }
+
+    // At the head, the next record is the first one the crypto worker still
+    // has pending, or the next one to be written
+    if (pos != head) {
+        seq = hdr.seq;
+    } else if (ring_write_head(chan) != head) {
+        ring_copy_out(chan, &hdr, head, sizeof(hdr));
+        seq = hdr.seq;
+    } else {
+        seq = READ_ONCE(chan->ring_ctrl->seq);
+    }
+
+    smp_store_release(&chan->ring_ctrl->cursors[reader->slot], pos);
+
+out:
+    percpu_up_read(&chan->ring_rwsem);
+    mutex_unlock(&chan->ring_write_lock);
+    mutex_unlock(&reader->lock);
+
+    if (retval) {
+        return retval;
+    }
+
+    ring_notify(chan); // there may be something to read now, or room to write
+    if (copy_to_user(user_seq, &seq, sizeof(seq))) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+// IOCTL_SET_RETENTION
+// Takes effect the next time a writer needs space. Shrinking the window
+// releases what it held then, growing it can only keep records that haven't
+// been released yet.
+static long ring_set_retention(struct ipc_channel *chan, struct ipc_retention __user *user_retention) {
+    struct ipc_retention retention;
+
+    if (copy_from_user(&retention, user_retention, sizeof(retention))) {
+        return -EFAULT;
+    }
+    if (retention.bytes > RING_MAX_SIZE) {
+        return -EINVAL;
+    }
+
+    if (mutex_lock_interruptible(&chan->ring_write_lock)) {
+        return -EINTR;
+    }
+    percpu_down_read(&chan->ring_rwsem);
+
+    WRITE_ONCE(chan->retain_messages, retention.messages);
+    WRITE_ONCE(chan->retain_bytes, retention.bytes);
+    chan->ring_ctrl->retain_messages = retention.messages;
+    chan->ring_ctrl->retain_bytes = retention.bytes;
+
+    percpu_up_read(&chan->ring_rwsem);
+    mutex_unlock(&chan->ring_write_lock);
+
+    ring_notify(chan); // pollers waiting for room re-check against the new window
+    return 0;
+}
+
+//  ENCRYPTON FUNCTIONS:
+// Encrypt the record payload sitting at 'off' in the ring
+// The ciphertext only goes into encrypted_mem, the record keeps the message as
+// written and read() hands it out as it is. So the legacy cipher doesn't hide
+// anything, pick an AEAD cipher for that.
+static int __encrypt_shared_memory(struct ipc_channel *chan, u64 off, size_t msg_len) {
+    u64 start = trace_ipc_encrypt_enabled() ? ktime_get_ns() : lat_start();
+
+    if (!chan->shared_mem || msg_len == 0) { // Check if there's anything to encrypt
+        return -EINVAL;
+    }
+
+    if (legacy_scratch_reserve(chan, msg_len)) {
+        return -ENOMEM;
+    }
+
+    // Read message from shared memory
+    // The whole message goes through, a binary one doesn't stop at its first 0
+    ring_copy_out(chan, chan->decrypted_mem, off, msg_len);
+    legacy_encrypt(&legacy_key, chan->encrypted_mem, chan->decrypted_mem, msg_len);
+
+    if (start) {
+        u64 ns = ktime_get_ns() - start;
+
+        trace_ipc_encrypt(IPC_CIPHER_LEGACY, msg_len, ns, 0);
+        if (latency_stats)
+            lat_add(chan, LAT_ENCRYPT, ns);
+    }
+
+    return 0; // Encryption done
+}
+
+// ASYNC CRYPTO
+// Encrypt the pending record at off in place
+// A compressed record's length prefix stays as it is, the rest gets encrypted
+static void ring_crypt_record(struct ipc_channel *chan, u64 off, const struct ipc_record_hdr *hdr) {
+    u32 cipher = hdr->flags & IPC_CIPHER_MASK;
+    struct crypto_aead *tfm = aead_tfm(chan, cipher);
+    size_t prefix = (hdr->flags & IPC_RECORD_LZ4) ? IPC_LZ4_PREFIX : 0;
+    u64 payload = off + sizeof(*hdr) + prefix;
+    u32 len = hdr->len - prefix;
+    int retval;
+
+    if (hdr->len < prefix) {
+        return; // mapping user corrupted the ring
+    }
+
+    if (cipher == IPC_CIPHER_LEGACY) {
+        mutex_lock(&chan->crypto_lock);
+        __encrypt_shared_memory(chan, payload, len);
+        mutex_unlock(&chan->crypto_lock);
+        return;
+    }
+
+    if (cipher != IPC_CIPHER_AES_GCM && cipher != IPC_CIPHER_CHACHA20_POLY1305) {
+        return; // stored as written
+    }
+
+    retval = -EBADMSG;
+    if (tfm && len >= AEAD_OVERHEAD) {
+        retval = bounce_reserve(&chan->crypt_bounce, &chan->crypt_bounce_size, len);
+    }
+    if (!retval) {
+        ring_copy_out(chan, chan->crypt_bounce + AEAD_NONCE_SIZE, payload + AEAD_NONCE_SIZE, len - AEAD_OVERHEAD);
+        retval = aead_seal(chan, cipher, chan->crypt_bounce, len - AEAD_OVERHEAD);
+    }
+    if (retval) {
+        // Don't leave the plaintext behind, readers will skip the record
+        printk(KERN_ERR "Failed to encrypt message: %d\n", retval);
+        ring_clear(chan, payload, len);
+        return;
+    }
+
+    ring_copy_in(chan, payload, chan->crypt_bounce, len);
+}
+
+// Encrypts every record written since the last run, then publishes them all
+// to readers with one head update and one wakeup
+static void ring_crypt_work(struct work_struct *work) {
+    struct ipc_channel *chan = container_of(work, struct ipc_channel, crypt_work);
+    u64 head, end, pos;
+
+    percpu_down_read(&chan->ring_rwsem);
+
+    head = READ_ONCE(chan->ring_ctrl->head);
+    end = smp_load_acquire(&chan->ring_reserved); // pairs with __ring_append, the records before it are filled in
+
+    if (end - head > chan->shm_size) { // an mmap producer pushed past them, or the ring was resized
+        percpu_up_read(&chan->ring_rwsem);
+        return;
+    }
+
+    for (pos = head; pos != end; ) {
+        struct ipc_record_hdr hdr;
+
+        ring_copy_out(chan, &hdr, pos, sizeof(hdr));
+        if (RECORD_SIZE(hdr.len) > end - pos) { // mapping user corrupted the ring
+            printk(KERN_ERR "Dropping %llu bytes of pending messages\n", end - pos);
+            ring_clear(chan, pos, end - pos);
+            pos = end;
+            break;
+        }
+
+        ring_crypt_record(chan, pos, &hdr);
+        pos += RECORD_SIZE(hdr.len);
+    }
+
+    // Publish the whole batch to readers, but only by moving the head on from
+    // where it was read. A run with nothing to do must not store it back, a
+    // plaintext write may have published past it meanwhile, and an mmap
+    // producer pushing concurrently wins over the batch the same way.
+    if (pos != head && cmpxchg_release(&chan->ring_ctrl->head, head, pos) != head) {
+        pos = head;
+    }
+
+    percpu_up_read(&chan->ring_rwsem);
+
+    if (pos != head) {
+        ring_notify(chan);
+    }
+}
+
+// DUPLICATE SUPPRESSION
+// Everything here runs under ring_write_lock, or on a channel nobody else can reach
+static void dedup_free(struct ipc_channel *chan) {
+    kvfree(chan->dedup_entries);
+    kvfree(chan->dedup_buckets);
+    chan->dedup_entries = NULL;
+    chan->dedup_buckets = NULL;
+    chan->dedup_size = 0;
+}
+
+// Swap in an empty window of the given size, 0 turns dedup off
+static int dedup_set_window(struct ipc_channel *chan, int window) {
+    struct ipc_dedup_entry *entries;
+    struct hlist_head *buckets;
+    int bits;
+
+    if (window < 0 || window > IPC_DEDUP_MAX_WINDOW) {
+        return -EINVAL;
+    }
+
+    if (window == 0) {
+        dedup_free(chan);
+        return 0;
+    }
+
+    // About one entry per bucket when the window is full, so a lookup is O(1)
+    bits = max(ilog2(roundup_pow_of_two(window)), 1);
+
+    // kvcalloc zeroes them, which is an empty bucket and an unhashed node
+    entries = kvcalloc(window, sizeof(*entries), GFP_KERNEL);
+    buckets = kvcalloc(1 << bits, sizeof(*buckets), GFP_KERNEL);
+    if (!entries || !buckets) {
+        kvfree(entries);
+        kvfree(buckets);
+        return -ENOMEM;
+    }
+
+    dedup_free(chan);
+    chan->dedup_entries = entries;
+    chan->dedup_buckets = buckets;
+    chan->dedup_bits = bits;
+    chan->dedup_size = window;
+    chan->dedup_next = 0;
+    return 0;
+}
+
+static bool dedup_seen(struct ipc_channel *chan, u64 hash) {
+    struct ipc_dedup_entry *entry;
+
+    hlist_for_each_entry(entry, &chan->dedup_buckets[hash_64(hash, chan->dedup_bits)], node) {
+        if (entry->hash == hash)
+            return true;
+    }
+    return false;
+}
+
+// Add hash to the window, pushing out the oldest one once it's full
+static void dedup_remember(struct ipc_channel *chan, u64 hash) {
+    struct ipc_dedup_entry *entry = &chan->dedup_entries[chan->dedup_next];
+
+    if (!hlist_unhashed(&entry->node)) {
+        hlist_del(&entry->node);
+    }
+
+    entry->hash = hash;
+    hlist_add_head(&entry->node, &chan->dedup_buckets[hash_64(hash, chan->dedup_bits)]);
+
+    chan->dedup_next = (chan->dedup_next + 1) % chan->dedup_size;
+}
+
+// Counts a message once its record is in the ring, so a write that fails
+// and gets retried, or a duplicate that's dropped, is only counted once.
+// lz4_len is what it was compressed to, 0 if it's stored as written.
+static void stats_written(struct ipc_channel *chan, size_t len, ssize_t lz4_len) {
+    struct ipc_cpu_stats *stats;
+
+    stats = get_cpu_ptr(chan->stats); // no migrating between the checks and the updates
+    stats->writes_count++;
+    stats->total_bytes_write += len;
+    if (len > stats->max_written) {
+        stats->max_written = len;   // update if current write is more than previous max
+    }
+    if (stats->writes_count == 1 || len < stats->min_written) {
+        stats->min_written = len;
+    }
+    if (lz4_len) {
+        stats->compressed++;
+        stats->compress_bytes_in += len;
+        stats->compress_bytes_out += lz4_len + IPC_LZ4_PREFIX;
+    } else if (chan->compress_mode == IPC_COMPRESS_LZ4) {
+        stats->compress_skipped++;
+    }
+    put_cpu_ptr(chan->stats);
+}
+
+// Write
+// Appends one record at the head, numbered with the channel's next sequence
+// number. Writers never wait for readers: if the ring doesn't have room for
+// the whole record it fails with -EAGAIN instead of overwriting messages
+// somebody hasn't read yet. Records only the retention window is keeping
+// are dropped, oldest first, to make room.
+// With an AEAD cipher set the record holds nonce | ciphertext | tag instead
+// of the message. In async_crypto mode the record is left for the worker to
+// encrypt and publish, see ring_crypt_work().
+// With compression on the message is compressed first (then encrypted), see
+// IPC_RECORD_LZ4; one that doesn't get smaller is stored as written.
+// A message whose unique_hash is in the channel's dedup window isn't queued
+// again, but write() still returns its length so a producer can retry safely. Its
+// hash only goes into the window once it's queued, so retrying after
+// -EAGAIN works.
+// Caller holds ring_write_lock and ring_rwsem for reading, and calls
+// ring_notify() once it's done appending.
+static ssize_t __ring_append(struct ipc_channel *chan, const char __user *user_buffer, size_t len) {
+    size_t stored_len = chan->cipher_tfm ? len + AEAD_OVERHEAD : len;
+    struct ipc_record_hdr hdr = { .len = stored_len, .flags = chan->cipher_mode, .stamp = ktime_get_ns() };
+    ssize_t lz4_len = 0; // compressed length, 0 if the message is stored as written
+    bool dedup = false;
+    u64 msg_hash = 0;
+    u64 head, tail;
+    u64 body;
+    int retval;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    // Messages too short to hold a unique_hash always go through
+    if (chan->dedup_size && len >= IPC_DEDUP_HASH_OFFSET + sizeof(msg_hash)) {
+        if (copy_from_user(&msg_hash, user_buffer + IPC_DEDUP_HASH_OFFSET, sizeof(msg_hash))) {
+            return -EFAULT;
+        }
+        if (dedup_seen(chan, msg_hash)) {
+            this_cpu_inc(chan->stats->duplicates);
+            return len;
+        }
+        dedup = true;
+    }
+
+    // Compressed into write_bounce, ready to be encrypted or copied in
+    if (chan->compress_mode == IPC_COMPRESS_LZ4) {
+        lz4_len = lz4_compress_from_user(chan, user_buffer, len);
+        if (lz4_len < 0) {
+            return lz4_len;
+        }
+        if (lz4_len) {
+            stored_len = IPC_LZ4_PREFIX + lz4_len + (chan->cipher_tfm ? AEAD_OVERHEAD : 0);
+            hdr.len = stored_len;
+            hdr.flags |= IPC_RECORD_LZ4;
+        }
+    }
+
+    tail = READ_ONCE(chan->ring_ctrl->tail);
+    head = ring_write_head(chan);
+
+    if (head - tail > chan->shm_size) { // mapping user corrupted the ring
+        return -EIO;
+    }
+
+    if (RECORD_SIZE(stored_len) > chan->shm_size) { // could never fit, even in an empty ring
+        return -EMSGSIZE;
+    }
+
+    if (RECORD_SIZE(stored_len) > chan->shm_size - (head - tail)) {
+        // See how far the readers have got and free what they're all done with
+        // (they can't be past the published head, whatever the worker still has pending),
+        // dropping retained records if that's what it takes to make room
+        tail = ring_reclaim_limit(chan, READ_ONCE(chan->ring_ctrl->head), tail,
+                                  RECORD_SIZE(stored_len) - (chan->shm_size - (head - tail)));
+        smp_store_release(&chan->ring_ctrl->tail, tail);
+    }
+
+    if (RECORD_SIZE(stored_len) > chan->shm_size - (head - tail)) { // full, the slowest reader has to catch up
+        return -EAGAIN;
+    }
+
+    // Numbered in the order they're appended, which is also the order readers
+    // get them in. The number is only used up once the record is in.
+    hdr.seq = READ_ONCE(chan->ring_ctrl->seq);
+
+    // The padding up to RECORD_ALIGN goes out with framed reads, don't let it
+    // carry whatever an older record left there
+    ring_clear(chan, head + sizeof(hdr) + stored_len, RECORD_SIZE(stored_len) - sizeof(hdr) - stored_len);
+
+    body = head + sizeof(hdr);
+    if (lz4_len) {
+        u32 orig_len = len;
+
+        ring_copy_in(chan, body, &orig_len, sizeof(orig_len)); // never encrypted, read() sizes buffers with it
+        body += IPC_LZ4_PREFIX;
+    }
+
+    // Anything but plaintext, or plaintext queued behind records the worker
+    // hasn't published yet, goes through the worker
+    if (async_crypto && (chan->cipher_mode != IPC_CIPHER_NONE || head != READ_ONCE(chan->ring_ctrl->head))) {
+        // Leave room for the nonce, the worker fills it in
+        if (chan->cipher_tfm) {
+            body += AEAD_NONCE_SIZE;
+        }
+        if (lz4_len) {
+            ring_copy_in(chan, body, chan->write_bounce + AEAD_NONCE_SIZE, lz4_len);
+        } else if (ring_copy_from_user(chan, body, user_buffer, len)) {
+            return -EFAULT;
+        }
+        ring_copy_in(chan, head, &hdr, sizeof(hdr));
+        WRITE_ONCE(chan->ring_ctrl->seq, hdr.seq + 1);
+
+        smp_store_release(&chan->ring_reserved, head + RECORD_SIZE(stored_len));
+        queue_work(crypt_wq, &chan->crypt_work);
+
+        trace_ipc_enqueue(chan->minor, head, len, stored_len, chan->cipher_mode, true);
+        stats_written(chan, len, lz4_len);
+
+        if (dedup) {
+            dedup_remember(chan, msg_hash);
+        }
+        return len;
+    }
+
+    if (lz4_len && chan->cipher_tfm) {
+        retval = aead_seal(chan, chan->cipher_mode, chan->write_bounce, lz4_len);
+        if (retval) {
+            return retval;
+        }
+        ring_copy_in(chan, body, chan->write_bounce, lz4_len + AEAD_OVERHEAD);
+    } else if (lz4_len) {
+        ring_copy_in(chan, body, chan->write_bounce + AEAD_NONCE_SIZE, lz4_len);
+    } else if (chan->cipher_tfm) {
+        retval = aead_encrypt_from_user(chan, user_buffer, len);
+        if (retval) {
+            return retval;
+        }
+        ring_copy_in(chan, body, chan->write_bounce, stored_len);
+    } else if (ring_copy_from_user(chan, body, user_buffer, len)) {
+        return -EFAULT;
+    }
+
+    ring_copy_in(chan, head, &hdr, sizeof(hdr));
+
+    if (chan->cipher_mode == IPC_CIPHER_LEGACY) {
+        // encrypt data
+        mutex_lock(&chan->crypto_lock);
+        __encrypt_shared_memory(chan, body, lz4_len ? lz4_len : len);
+        mutex_unlock(&chan->crypto_lock);
+    }
+
+    WRITE_ONCE(chan->ring_ctrl->seq, hdr.seq + 1);
+    WRITE_ONCE(chan->ring_reserved, head + RECORD_SIZE(stored_len));
+    smp_store_release(&chan->ring_ctrl->head, head + RECORD_SIZE(stored_len)); // publish the record to readers
+
+    trace_ipc_enqueue(chan->minor, head, len, stored_len, chan->cipher_mode, false);
+    stats_written(chan, len, lz4_len);
+
+    if (dedup) {
+        dedup_remember(chan, msg_hash);
+    }
+    return len;
+}
+
+// Appends the buffer as one record
+static ssize_t device_write(struct file *file, const char __user *user_buffer, size_t len, loff_t *offset) {
+    struct ipc_file *f = file->private_data;
+    struct ipc_channel *chan = f->chan;
+    u64 start = lat_start();
+    ssize_t bytes_written;
+
+    this_cpu_inc(chan->stats->userspace_accesses);
+
+    // Readers only move their own cursors, so they can keep going while we
+    // fill in free space; we only have to keep out other writers.
+    if (mutex_lock_interruptible(&chan->ring_write_lock)) {
+        return -EINTR;
+    }
+    percpu_down_read(&chan->ring_rwsem);
+    lat_end(chan, LAT_ENQUEUE_WAIT, start);
+
+    bytes_written = __ring_append(chan, user_buffer, len);
+    if (bytes_written > 0) {
+        ring_notify(chan);
+    }
+
+    percpu_up_read(&chan->ring_rwsem);
+    mutex_unlock(&chan->ring_write_lock);
+
+    return bytes_written;
+}
+
+// Batched write (IOCTL_WRITE_BATCH)
+// Appends every message in the batch under a single lock acquisition and
+// wakes readers once at the end. Each entry gets its own status. Once one
+// message doesn't fit, the rest are failed with -EAGAIN as well, so a caller
+// that retries from the first failure keeps the messages in order.
+// Returns how many messages were queued.
+static long ring_write_batch(struct ipc_channel *chan, struct ipc_batch __user *user_batch) {
+    struct ipc_batch batch;
+    struct ipc_batch_entry *entries;
+    long written = 0;
+    bool full = false;
+    u64 start;
+
+    if (copy_from_user(&batch, user_batch, sizeof(batch))) {
+        return -EFAULT;
+    }
+
+    if (batch.count == 0) {
+        return 0;
+    }
+    if (batch.count > IPC_BATCH_MAX) {
+        return -EINVAL;
+    }
+
+    entries = kmalloc_array(batch.count, sizeof(*entries), GFP_KERNEL);
+    if (!entries) {
+        return -ENOMEM;
+    }
+
+    if (copy_from_user(entries, u64_to_user_ptr(batch.entries), batch.count * sizeof(*entries))) {
+        kfree(entries);
+        return -EFAULT;
+    }
+
+    start = lat_start();
+    if (mutex_lock_interruptible(&chan->ring_write_lock)) {
+        kfree(entries);
+        return -EINTR;
+    }
+    percpu_down_read(&chan->ring_rwsem);
+    lat_end(chan, LAT_ENQUEUE_WAIT, start); // once for the whole batch
+
+    for (u32 i = 0; i < batch.count; i++) {
+        ssize_t retval = -EAGAIN;
+
+        if (!full) {
+            retval = __ring_append(chan, u64_to_user_ptr(entries[i].data), entries[i].len);
+            full = (retval == -EAGAIN);
+        }
+
+        entries[i].status = retval;
+        if (retval >= 0) {
+            written++;
+        }
+    }
+
+    if (written > 0) {
+        ring_notify(chan);
+    }
+
+    percpu_up_read(&chan->ring_rwsem);
+    mutex_unlock(&chan->ring_write_lock);
+
+    batch.written = written;
+    if (copy_to_user(u64_to_user_ptr(batch.entries), entries, batch.count * sizeof(*entries)) ||
+        copy_to_user(user_batch, &batch, sizeof(batch))) {
+        written = -EFAULT;
+    }
+
+    kfree(entries);
+    return written;
+}
+
+
+
+// Add up every CPU's counters
+static void stats_fold(struct ipc_channel *chan, struct ipc_stats *out) {
+    int cpu;
+
+    memset(out, 0, sizeof(*out));
+
+    for_each_possible_cpu(cpu) {
+        struct ipc_cpu_stats *stats = per_cpu_ptr(chan->stats, cpu);
+        u64 writes = READ_ONCE(stats->writes_count);
+
+        out->userspace_accesses += READ_ONCE(stats->userspace_accesses);
+        out->total_bytes_read += READ_ONCE(stats->total_bytes_read);
+        out->total_bytes_write += READ_ONCE(stats->total_bytes_write);
+        out->reads_count += READ_ONCE(stats->reads_count);
+        out->duplicates += READ_ONCE(stats->duplicates);
+        out->compressed += READ_ONCE(stats->compressed);
+        out->compress_skipped += READ_ONCE(stats->compress_skipped);
+        out->compress_bytes_in += READ_ONCE(stats->compress_bytes_in);
+        out->compress_bytes_out += READ_ONCE(stats->compress_bytes_out);
+        out->compress_ns += READ_ONCE(stats->compress_ns);
+        out->decompress_ns += READ_ONCE(stats->decompress_ns);
+        out->max_written = max(out->max_written, READ_ONCE(stats->max_written));
+        if (writes && (!out->writes_count || READ_ONCE(stats->min_written) < out->min_written)) {
+            out->min_written = READ_ONCE(stats->min_written);
+        }
+        out->writes_count += writes;
+    }
+}
+
+// https://www.kernel.org/doc/html/latest/filesystems/seq_file.html
+// /proc/ipc_stats, seq_file takes care of offsets and partial reads
+// One block per channel
+static int stats_show(struct seq_file *m, void *v) {
+    struct ipc_channel *chan;
+    struct ipc_stats stats;
+    u64 ratio, ratio_whole, attempts;
+    int minor;
+
+    mutex_lock(&channels_lock); // channels in the table can't go away while we look at them
+
+    for (minor = 0; minor < IPC_MAX_CHANNELS; minor++) {
+        chan = channel_table[minor];
+        if (!chan)
+            continue;
+
+        stats_fold(chan, &stats);
+
+        seq_printf(m,
+            "Channel %d:\n"
+            "Userspace accesses: %llu\n"
+            "Total bytes read: %llu\n"
+            "Total bytes written: %llu\n"
+            "Reads count: %llu\n"
+            "Writes count: %llu\n"
+            "Max written: %llu\n"
+            "Min written: %llu\n"
+            "Avg bytes written: %llu\n"
+            "Duplicates dropped: %llu\n",
+            minor,
+            stats.userspace_accesses, stats.total_bytes_read, stats.total_bytes_write,
+            stats.reads_count, stats.writes_count, stats.max_written, stats.min_written,
+            stats.writes_count ? div64_u64(stats.total_bytes_write, stats.writes_count) : 0,
+            stats.duplicates);
+
+        // Ratio of the compressed messages only, in hundredths (no floats in the kernel)
+        ratio = stats.compress_bytes_out ? div64_u64(stats.compress_bytes_in * 100, stats.compress_bytes_out) : 0;
+        ratio_whole = div_u64(ratio, 100);
+        attempts = stats.compressed + stats.compress_skipped;
+        seq_printf(m,
+            "Compressed messages: %llu (%llu stored as written)\n"
+            "Compression ratio: %llu.%02llu (%llu -> %llu bytes)\n"
+            "Compress time: %llu ns (avg %llu ns)\n"
+            "Decompress time: %llu ns\n\n",
+            stats.compressed, stats.compress_skipped,
+            ratio_whole, ratio - ratio_whole * 100, stats.compress_bytes_in, stats.compress_bytes_out,
+            stats.compress_ns, attempts ? div64_u64(stats.compress_ns, attempts) : 0,
+            stats.decompress_ns);
+    }
+
+    mutex_unlock(&channels_lock);
+    return 0;
+}
+
+// Smallest bucket upper bound that at least permille/1000 of the samples fall under
+static u64 latency_percentile(const u64 *buckets, u64 total, unsigned int permille) {
+    u64 wanted = div_u64(total * permille + 999, 1000);
+    u64 seen = 0;
+    int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= wanted)
+            return b ? 1ULL << b : 0;
+    }
+    return U64_MAX;
+}
+
+// One channel's part of /proc/ipc_latency
+static void latency_show_channel(struct seq_file *m, struct ipc_channel *chan) {
+    u64 buckets[LAT_BUCKETS];
+    int stage, b, cpu;
+
+    seq_printf(m, "Channel %d:\n", chan->minor);
+    seq_printf(m, "%-14s %12s %12s %12s %12s\n", "stage", "count", "p50_ns", "p99_ns", "p999_ns");
+
+    for (stage = 0; stage < LAT_STAGES; stage++) {
+        u64 total = 0;
+
+        memset(buckets, 0, sizeof(buckets));
+        for_each_possible_cpu(cpu) {
+            struct ipc_cpu_latency *lat = per_cpu_ptr(chan->latency, cpu);
+
+            for (b = 0; b < LAT_BUCKETS; b++)
+                buckets[b] += READ_ONCE(lat->buckets[stage][b]);
+        }
+        for (b = 0; b < LAT_BUCKETS; b++)
+            total += buckets[b];
+
+        if (!total) {
+            seq_printf(m, "%-14s %12d %12s %12s %12s\n", lat_stage_names[stage], 0, "-", "-", "-");
+            continue;
+        }
+
+        seq_printf(m, "%-14s %12llu %12llu %12llu %12llu\n", lat_stage_names[stage], total,
+                   latency_percentile(buckets, total, 500),
+                   latency_percentile(buckets, total, 990),
+                   latency_percentile(buckets, total, 999));
+    }
+    seq_putc(m, '\n');
+}
+
+// /proc/ipc_latency, one line per stage for each channel, percentiles rounded up to a power of two
+static int latency_show(struct seq_file *m, void *v) {
+    int minor;
+
+    mutex_lock(&channels_lock);
+    for (minor = 0; minor < IPC_MAX_CHANNELS; minor++) {
+        if (channel_table[minor])
+            latency_show_channel(m, channel_table[minor]);
+    }
+    mutex_unlock(&channels_lock);
+
+    return 0;
+}
+
+// IOCTL_RESET_LATENCY
+// Not atomic against messages in flight, a few of their samples may survive
+static void latency_reset(struct ipc_channel *chan) {
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        memset(per_cpu_ptr(chan->latency, cpu), 0, sizeof(struct ipc_cpu_latency));
+    }
+}
+
+
+module_init(device_init); // initialising func
+module_exit(device_exit); // exit func
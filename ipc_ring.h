@@ -0,0 +1,318 @@
+// Layout of the message ring, shared by the driver and by user programs that
+// mmap() /dev/ipc_device (or another channel's /dev/ipc_deviceN, each channel
+// has its own ring), plus the structs passed to its ioctls.
+//
+// The mapping is one control page followed by the data pages:
+//
+//   offset 0          struct ipc_ring_ctrl (producer index, reader cursors)
+//   offset PAGE_SIZE  ring data, ctrl->size bytes
+//
+// head, tail and the cursors are byte offsets that only ever grow, the
+// position in the data area is the offset modulo ctrl->size. Each message is
+// stored as a record: an ipc_record_hdr followed by the payload, padded to
+// RECORD_ALIGN.
+//
+// Every file opened for reading gets its own cursor slot (IOCTL_GET_READER_SLOT),
+// so each reader sees every message once. A read-only open gets it straight
+// away, a read-write one (needed to map the ring writable) only once it reads,
+// polls for input or asks for its slot, so a producer pushing through the
+// mapping doesn't hold the ring up. tail is the oldest record still
+// kept: the producer moves it up to the slowest reader's cursor (or the start
+// of the retention window, see IOCTL_SET_RETENTION) when it runs out of
+// space, and everything before it can be overwritten.
+//
+// Every record carries a sequence number, one more than the record before it,
+// so a reader can tell whether it missed any and, after a restart, pick up
+// where it left off with IOCTL_SEEK_SEQ.
+//
+// There is one producer index. The driver's write() counts as a producer, so
+// a process that pushes through the mapping must be the only writer. After
+// pushing or popping through the mapping, call IOCTL_RING_NOTIFY so sleepers
+// in read()/poll() get woken up.
+#ifndef IPC_RING_H
+#define IPC_RING_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define IPC_RING_MAX_READERS 256 // cursor slots in the control page
+
+struct ipc_ring_ctrl {
+    __u64 head;  // where the next record gets written
+    __u64 tail;  // oldest record still kept, see above
+    __u32 size;  // size of the data area in bytes, a multiple of RECORD_ALIGN
+    __u32 flags; // unused for now
+    __u64 seq;   // sequence number the next record gets
+    __u32 retain_messages; // retention window, maintained by the driver
+    __u32 retain_bytes;
+    __u64 readers[IPC_RING_MAX_READERS / 64];  // bitmap of cursor slots in use, maintained by the driver
+    __u64 cursors[IPC_RING_MAX_READERS];       // next record each reader will read
+};
+
+struct ipc_record_hdr {
+    __u32 len;   // payload length in bytes
+    __u32 flags; // IPC_CIPHER_* the payload was stored with, plus IPC_RECORD_LZ4 if it's compressed
+    __u64 stamp; // CLOCK_MONOTONIC ns when write() queued it, 0 if pushed through the mapping
+    __u64 seq;   // ctrl->seq when it was written, they count up from 0 per channel
+};
+
+// Ciphers for IOCTL_SET_KEY. Records written with an AEAD cipher are stored
+// as nonce | ciphertext | tag and only decrypted by read(), so a process
+// popping them straight out of the mapping gets the encrypted bytes. With the
+// module's async_crypto on, a record is plaintext in the mapped pages from
+// write() until the driver's worker seals it, a short while later.
+#define IPC_CIPHER_NONE 0              // stored as written
+#define IPC_CIPHER_LEGACY 1            // the original RSA demo, the default; runs on a copy, the record stays plaintext
+#define IPC_CIPHER_AES_GCM 2           // gcm(aes), 16, 24 or 32 byte key
+#define IPC_CIPHER_CHACHA20_POLY1305 3 // rfc7539(chacha20,poly1305), 32 byte key
+
+#define IPC_CIPHER_MASK 0xff // the cipher's part of a record's flags
+
+#define IPC_KEY_MAX 32
+
+struct ipc_key {
+    __u32 cipher;  // IPC_CIPHER_*
+    __u32 key_len; // bytes of key used, 0 for NONE and LEGACY
+    __u8 key[IPC_KEY_MAX];
+};
+
+// IOCTL_WRITE_BATCH takes a struct ipc_batch pointing at an array of entries,
+// one per message. The driver fills in each entry's status (bytes written or
+// -errno) and the batch's written count.
+#define IPC_BATCH_MAX 1024 // most entries a single batch may carry
+
+struct ipc_batch_entry {
+    __u64 data;   // pointer to the message
+    __u32 len;    // message length in bytes
+    __s32 status; // out: bytes written, or -errno
+};
+
+struct ipc_batch {
+    __u64 entries; // pointer to an array of struct ipc_batch_entry
+    __u32 count;   // number of entries
+    __u32 written; // out: how many messages were queued
+};
+
+// Compression (IOCTL_SET_COMPRESS takes one of these). With LZ4 on, every
+// message written from then on is compressed with the kernel's LZ4 before
+// it's encrypted, and stored that way if it came out smaller. Its record has
+// IPC_RECORD_LZ4 in its flags and its payload is the message's real length
+// as a __u32 (IPC_LZ4_PREFIX bytes, never encrypted) followed by the LZ4
+// block, or nonce | encrypted LZ4 block | tag with an AEAD cipher. read()
+// hands out the message as it was written, popping it out of the mapping
+// gets the compressed record.
+#define IPC_COMPRESS_NONE 0
+#define IPC_COMPRESS_LZ4 1
+
+#define IPC_RECORD_LZ4 0x100
+#define IPC_LZ4_PREFIX 4
+
+// Read modes for IOCTL_SET_READ_MODE. A framed read() returns as many whole
+// records as fit in the buffer, each laid out as in the ring: an
+// ipc_record_hdr, the payload, then padding up to RECORD_ALIGN. AEAD records
+// and compressed records come out already decrypted and decompressed, with
+// the message's length and IPC_CIPHER_NONE in their header (the stamp and seq
+// are kept).
+#define IPC_READ_SINGLE 0 // one message payload per read() (the default)
+#define IPC_READ_FRAMED 1 // a batch of framed records per read()
+
+// Returned by IOCTL_GET_STATS, the same numbers /proc/ipc_stats prints
+struct ipc_stats {
+    __u64 userspace_accesses; // open, close, read and write calls
+    __u64 total_bytes_read;   // bytes handed out by read()
+    __u64 total_bytes_write;  // bytes of the messages that went into the ring
+    __u64 reads_count;        // read() calls that handed out messages, failed ones don't count
+    __u64 writes_count;       // messages that went into the ring, failed writes and duplicates don't count
+    __u64 max_written;        // biggest message written
+    __u64 min_written;        // smallest message written, 0 before the first write
+    __u64 duplicates;         // writes dropped by IOCTL_SET_DEDUP
+    __u64 compressed;         // messages stored LZ4 compressed
+    __u64 compress_skipped;   // messages that didn't get any smaller, stored as written
+    __u64 compress_bytes_in;  // bytes of the messages given to LZ4
+    __u64 compress_bytes_out; // bytes they took up in the ring afterwards
+    __u64 compress_ns;        // time spent compressing
+    __u64 decompress_ns;      // time spent decompressing
+};
+
+// Duplicate suppression (IOCTL_SET_DEDUP takes the window size). Messages laid
+// out as a struct message_data (message.h) carry their 64-bit unique_hash at
+// IPC_DEDUP_HASH_OFFSET. With a window set the channel remembers that many of
+// the most recent hashes and drops a message whose hash it still remembers;
+// write() returns its length anyway, so a producer can resend freely.
+#define IPC_DEDUP_HASH_OFFSET 24
+#define IPC_DEDUP_MAX_WINDOW (1 << 20)
+
+// IOCTL_SEEK_SEQ takes the sequence number of the next message a reader
+// wants, e.g. one past the last one it handled before it was restarted, and
+// moves its cursor to that record. If the record isn't kept any more the
+// cursor goes to the oldest one that is, and if it hasn't been written yet, to
+// the head. The sequence number the cursor ended up at is written back, so a
+// bigger one than asked for means the messages in between were lost and a
+// smaller one that the numbers started over (the module was reloaded).
+
+// Retention (IOCTL_SET_RETENTION). Normally a record's space can be reused
+// as soon as every reader is past it. With a window set the ring also keeps
+// the last 'messages' records, and every record that starts in the last
+// 'bytes' bytes, as long as nothing else needs the space. It's best effort:
+// a writer that needs room gets it by dropping the oldest kept records, so
+// only readers ever make writers wait, and a window bigger than the ring just
+// keeps whatever fits. 0 and 0 (the default) keeps nothing extra.
+struct ipc_retention {
+    __u32 messages;
+    __u32 bytes;
+};
+
+#define RECORD_ALIGN 8
+#define RECORD_SIZE(len) (((sizeof(struct ipc_record_hdr) + (len)) + RECORD_ALIGN - 1) & ~((__u64)RECORD_ALIGN - 1))
+
+#define IPC_IOCTL_MAGIC 42 // the driver's major number
+
+// https://embetronicx.com/tutorials/linux/device-drivers/ioctl-tutorial-in-linux/
+#define IOCTL_GET_SHM_SIZE _IOR(IPC_IOCTL_MAGIC, 0, int) // get shared memory (/buffer) size
+#define IOCTL_SET_SHM_SIZE _IOW(IPC_IOCTL_MAGIC, 1, int) // set shared memory (/buffer) size
+#define IOCTL_GET_READER_COUNT _IOR(IPC_IOCTL_MAGIC, 2, int) // get number of readers that have the device open
+#define IOCTL_GET_CURRENT_BUFFER_SIZE _IOR(IPC_IOCTL_MAGIC, 3, int) // get the length of the current string in the buffer
+#define IOCTL_RING_NOTIFY _IO(IPC_IOCTL_MAGIC, 4) // wake sleepers after pushing/popping through the mmap'd ring
+#define IOCTL_GET_READER_SLOT _IOR(IPC_IOCTL_MAGIC, 5, int) // get this reader's cursor slot in the mmap'd control page
+#define IOCTL_WRITE_BATCH _IOWR(IPC_IOCTL_MAGIC, 6, struct ipc_batch) // append many messages in one call
+#define IOCTL_SET_READ_MODE _IOW(IPC_IOCTL_MAGIC, 7, int) // IPC_READ_SINGLE or IPC_READ_FRAMED for this reader
+#define IOCTL_SET_KEY _IOW(IPC_IOCTL_MAGIC, 8, struct ipc_key) // pick the cipher for new messages and install its key
+#define IOCTL_GET_STATS _IOR(IPC_IOCTL_MAGIC, 9, struct ipc_stats) // same numbers as /proc/ipc_stats, in binary
+#define IOCTL_RESET_LATENCY _IO(IPC_IOCTL_MAGIC, 10) // start the /proc/ipc_latency histograms over
+#define IOCTL_CREATE_CHANNEL _IOR(IPC_IOCTL_MAGIC, 11, int) // add a channel, returns its minor number
+#define IOCTL_DESTROY_CHANNEL _IOW(IPC_IOCTL_MAGIC, 12, int) // remove the channel with this minor number
+#define IOCTL_SET_DEDUP _IOW(IPC_IOCTL_MAGIC, 13, int) // remember this many recent unique_hash values, 0 turns dedup off
+#define IOCTL_SEEK_SEQ _IOWR(IPC_IOCTL_MAGIC, 14, __u64) // move this reader's cursor to a sequence number, returns where it landed
+#define IOCTL_SET_RETENTION _IOW(IPC_IOCTL_MAGIC, 15, struct ipc_retention) // keep this many recent messages / bytes for readers that seek back
+#define IOCTL_SET_COMPRESS _IOW(IPC_IOCTL_MAGIC, 16, int) // IPC_COMPRESS_LZ4 or IPC_COMPRESS_NONE for messages written from now on
+
+#ifndef __KERNEL__
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+// How many bytes to mmap() for a ring with shm_size bytes of data
+static inline size_t ipc_ring_map_size(size_t shm_size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return page + ((shm_size + page - 1) & ~(page - 1));
+}
+
+// The data area starts on the page after the control page
+static inline char *ipc_ring_data(struct ipc_ring_ctrl *ctrl) {
+    return (char *)ctrl + sysconf(_SC_PAGESIZE);
+}
+
+static inline void ipc_ring_copy_in(struct ipc_ring_ctrl *ctrl, __u64 off, const void *src, size_t len) {
+    char *data = ipc_ring_data(ctrl);
+    size_t pos = off % ctrl->size;
+    size_t first = len < ctrl->size - pos ? len : ctrl->size - pos;
+
+    memcpy(data + pos, src, first);
+    memcpy(data, (const char *)src + first, len - first);
+}
+
+static inline void ipc_ring_copy_out(struct ipc_ring_ctrl *ctrl, void *dst, __u64 off, size_t len) {
+    char *data = ipc_ring_data(ctrl);
+    size_t pos = off % ctrl->size;
+    size_t first = len < ctrl->size - pos ? len : ctrl->size - pos;
+
+    memcpy(dst, data + pos, first);
+    memcpy((char *)dst + first, data, len - first);
+}
+
+// How far the tail can move from tail towards limit without dropping a record
+// the retention window covers, unless that's the only way to free need bytes
+static inline __u64 ipc_ring_retain(struct ipc_ring_ctrl *ctrl, __u64 head, __u64 tail, __u64 limit, __u64 need) {
+    __u64 seq = ctrl->seq;
+    __u64 pos = tail;
+
+    if ((!ctrl->retain_messages && !ctrl->retain_bytes) || head - tail > ctrl->size)
+        return limit;
+
+    while (pos != limit) {
+        struct ipc_record_hdr hdr;
+
+        ipc_ring_copy_out(ctrl, &hdr, pos, sizeof(hdr));
+        if (RECORD_SIZE(hdr.len) > limit - pos)
+            return limit; // not a record, whatever is there can't be kept anyway
+        if (pos - tail >= need && (seq - hdr.seq <= ctrl->retain_messages || head - pos <= ctrl->retain_bytes))
+            break;
+        pos += RECORD_SIZE(hdr.len);
+    }
+    return pos;
+}
+
+// Cursor of the slowest reader, or the head if there are none
+static inline __u64 ipc_ring_slowest_reader(struct ipc_ring_ctrl *ctrl) {
+    __u64 head = ctrl->head;
+    __u64 tail = ctrl->tail;
+    __u64 new_tail = head; // with no readers everything can go
+
+    for (int slot = 0; slot < IPC_RING_MAX_READERS; slot++) {
+        if (!(__atomic_load_n(&ctrl->readers[slot / 64], __ATOMIC_ACQUIRE) & (1ULL << (slot % 64))))
+            continue;
+
+        __u64 cursor = __atomic_load_n(&ctrl->cursors[slot], __ATOMIC_ACQUIRE);
+        if (cursor - tail <= head - tail && cursor - tail < new_tail - tail)
+            new_tail = cursor;
+    }
+    return new_tail;
+}
+
+// Move the tail up to the slowest reader (or the retention window), freeing
+// what everyone has read. The window gives up its oldest records until at
+// least need bytes past the tail are free, if the readers allow it.
+static inline __u64 ipc_ring_reclaim(struct ipc_ring_ctrl *ctrl, __u64 need) {
+    __u64 tail = ctrl->tail;
+    __u64 new_tail = ipc_ring_retain(ctrl, ctrl->head, tail, ipc_ring_slowest_reader(ctrl), need);
+
+    __atomic_store_n(&ctrl->tail, new_tail, __ATOMIC_RELEASE);
+    return new_tail;
+}
+
+// Append one message to the mapped ring
+// Returns 0, or -EAGAIN if the ring is full and -EMSGSIZE if it could never fit
+static inline int ipc_ring_push(struct ipc_ring_ctrl *ctrl, const void *msg, __u32 len) {
+    __u64 tail = __atomic_load_n(&ctrl->tail, __ATOMIC_ACQUIRE);
+    __u64 head = ctrl->head;
+    struct ipc_record_hdr hdr = { .len = len, .flags = IPC_CIPHER_NONE, .stamp = 0, .seq = ctrl->seq };
+    static const char zeros[RECORD_ALIGN];
+
+    if (RECORD_SIZE(len) > ctrl->size)
+        return -EMSGSIZE;
+    if (RECORD_SIZE(len) > ctrl->size - (head - tail))
+        tail = ipc_ring_reclaim(ctrl, RECORD_SIZE(len) - (ctrl->size - (head - tail))); // see if readers have moved on since
+    if (RECORD_SIZE(len) > ctrl->size - (head - tail))
+        return -EAGAIN;
+
+    ipc_ring_copy_in(ctrl, head, &hdr, sizeof(hdr));
+    ipc_ring_copy_in(ctrl, head + sizeof(hdr), msg, len);
+    ipc_ring_copy_in(ctrl, head + sizeof(hdr) + len, zeros, RECORD_SIZE(len) - sizeof(hdr) - len); // padding
+    ctrl->seq = hdr.seq + 1;
+
+    __atomic_store_n(&ctrl->head, head + RECORD_SIZE(len), __ATOMIC_RELEASE); // publish
+    return 0;
+}
+
+// Take the next message for the reader in cursor slot 'slot' out of the mapped ring
+// Returns its length, 0 if there's nothing new, or -EMSGSIZE if buf is too small
+static inline long ipc_ring_pop(struct ipc_ring_ctrl *ctrl, int slot, void *buf, size_t buf_len) {
+    __u64 head = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE); // records before this are complete
+    __u64 cursor = ctrl->cursors[slot];
+    struct ipc_record_hdr hdr;
+
+    if (head == cursor)
+        return 0;
+
+    ipc_ring_copy_out(ctrl, &hdr, cursor, sizeof(hdr));
+    if (hdr.len > buf_len)
+        return -EMSGSIZE;
+
+    ipc_ring_copy_out(ctrl, buf, cursor + sizeof(hdr), hdr.len);
+
+    __atomic_store_n(&ctrl->cursors[slot], cursor + RECORD_SIZE(hdr.len), __ATOMIC_RELEASE); // done with it
+    return hdr.len;
+}
+#endif
+
+#endif
@@ -0,0 +1,152 @@
+// Tracepoints for the IPC driver, these replace the printk()s that used to
+// run on every open/read/write and cost nothing while they're disabled.
+//
+// https://docs.kernel.org/trace/tracepoints.html
+// https://lwn.net/Articles/379903/
+//
+// Turn them on with ftrace:
+//   echo 1 > /sys/kernel/tracing/events/ipc/enable
+//   cat /sys/kernel/tracing/trace_pipe
+// or record them with perf:
+//   perf record -e 'ipc:*' -a
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ipc
+
+#if !defined(_IPC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _IPC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// A file was opened on channel minor, slot is the reader's cursor slot or
+// -1 for write-only files
+TRACE_EVENT(ipc_open,
+    TP_PROTO(int minor, int slot, unsigned int f_flags),
+    TP_ARGS(minor, slot, f_flags),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(int, slot)
+        __field(unsigned int, f_flags)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->slot = slot;
+        __entry->f_flags = f_flags;
+    ),
+
+    TP_printk("minor=%d slot=%d f_flags=0x%x", __entry->minor, __entry->slot, __entry->f_flags)
+);
+
+TRACE_EVENT(ipc_release,
+    TP_PROTO(int minor, int slot),
+    TP_ARGS(minor, slot),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(int, slot)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->slot = slot;
+    ),
+
+    TP_printk("minor=%d slot=%d", __entry->minor, __entry->slot)
+);
+
+// A message was appended at pos on channel minor. pending means it's waiting for the crypto
+// worker and isn't visible to readers yet.
+TRACE_EVENT(ipc_enqueue,
+    TP_PROTO(int minor, u64 pos, u32 len, u32 stored_len, u32 cipher, bool pending),
+    TP_ARGS(minor, pos, len, stored_len, cipher, pending),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(u64, pos)
+        __field(u32, len)
+        __field(u32, stored_len)
+        __field(u32, cipher)
+        __field(bool, pending)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->len = len;
+        __entry->stored_len = stored_len;
+        __entry->cipher = cipher;
+        __entry->pending = pending;
+    ),
+
+    TP_printk("minor=%d pos=%llu len=%u stored_len=%u cipher=%u pending=%d",
+              __entry->minor, __entry->pos, __entry->len, __entry->stored_len, __entry->cipher, __entry->pending)
+);
+
+// A read() handed records from pos onwards to the reader in slot of channel minor
+TRACE_EVENT(ipc_dequeue,
+    TP_PROTO(int minor, int slot, u64 pos, u32 records, size_t bytes),
+    TP_ARGS(minor, slot, pos, records, bytes),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(int, slot)
+        __field(u64, pos)
+        __field(u32, records)
+        __field(size_t, bytes)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->slot = slot;
+        __entry->pos = pos;
+        __entry->records = records;
+        __entry->bytes = bytes;
+    ),
+
+    TP_printk("minor=%d slot=%d pos=%llu records=%u bytes=%zu",
+              __entry->minor, __entry->slot, __entry->pos, __entry->records, __entry->bytes)
+);
+
+// Encrypting and decrypting share a layout: which cipher, how many bytes of
+// plaintext, how long it took and how it went
+DECLARE_EVENT_CLASS(ipc_crypt,
+    TP_PROTO(u32 cipher, size_t len, u64 duration_ns, int ret),
+    TP_ARGS(cipher, len, duration_ns, ret),
+
+    TP_STRUCT__entry(
+        __field(u32, cipher)
+        __field(size_t, len)
+        __field(u64, duration_ns)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->cipher = cipher;
+        __entry->len = len;
+        __entry->duration_ns = duration_ns;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("cipher=%u len=%zu duration_ns=%llu ret=%d",
+              __entry->cipher, __entry->len, __entry->duration_ns, __entry->ret)
+);
+
+DEFINE_EVENT(ipc_crypt, ipc_encrypt,
+    TP_PROTO(u32 cipher, size_t len, u64 duration_ns, int ret),
+    TP_ARGS(cipher, len, duration_ns, ret)
+);
+
+DEFINE_EVENT(ipc_crypt, ipc_decrypt,
+    TP_PROTO(u32 cipher, size_t len, u64 duration_ns, int ret),
+    TP_ARGS(cipher, len, duration_ns, ret)
+);
+
+#endif
+
+// The driver is built out of tree, so tell define_trace.h where to find us
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ipc_trace
+#include <trace/define_trace.h>
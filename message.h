@@ -1,4 +1,7 @@
 // The struct for all the metadata the emssage contains (and the message itself)
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
 struct message_data {
     pid_t writer_pid;       // Process ID of the writer
     time_t timestamp;       // When the message was created
@@ -6,3 +9,5 @@ struct message_data {
     int64_t unique_hash; // Used for identifying unique messages
     char message[];         // La message
 };
+
+#endif
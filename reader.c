@@ -2,6 +2,7 @@
 /// Reader program for the user-space. Its function is take data from kernel space and output it. 
 /// It consists of a parent thread and two child processes. Parent thread continously reads from device while 
 /// the two child processes, one for console output and one for log-file, display the messages.
+/// Each child has its own queue, so a slow log file doesn't hold up the device or the console.
 ///<summary>
 
 #include <stdio.h>
@@ -11,28 +12,101 @@
 #include <pthread.h>  // Threading
 #include <string.h>   // String manipulation
 #include <sys/ioctl.h> //for ioctl
+#include <stdint.h>
+#include <stdatomic.h> // queue indices and message refcounts
+#include <semaphore.h> // sleeping on an empty or full queue
+#include <errno.h>
+#include <sys/uio.h>   // writev() for the log
+#include <sys/stat.h>
+#include <time.h>     // ageing hashes out of the dedup window
+#include <dirent.h>   // finding the last binary log segment
 #include "message.h"
+#include "ipc_client.h" // libipc, the device or its shared memory stand-in
+#include "ipc_log.h"  // binary log segments, see -L
 
-#define IOCTL_GET_SHM_SIZE _IOR(42, 0, int)
-#define IOCTL_SET_SHM_SIZE _IOW(42, 1, int)
-#define IOCTL_GET_READER_COUNT _IOR(42, 2, int)
-#define IOCTL_GET_CURRENT_BUFFER_SIZE _IOR(42, 3, int)
-
-#define DEVICE_PATH "/dev/ipc_device"
 #define LOG_FILE_PATH "/tmp/reader_log.txt" // macro for path to log file
+#define LOG_KEEP 5 // rotated logs kept around, reader_log.txt.1 is the newest
+
+const char* device_path = IPC_DEFAULT_DEVICE; // which channel to read, see -d
+enum ipc_backend backend = IPC_BACKEND_AUTO; // -U for the shared memory ring
+
+// CHECKPOINT
+// With -C the sequence number of the next message the log needs is kept in
+// a file, so a restarted reader can seek back to it and only gets the
+// messages it hasn't logged yet. With -S it's only written once the log has
+// been synced, and synced itself after that, so on disk it never points past
+// what the log has; without -S it's updated after every batch and is as good
+// as the page cache. Messages written while the reader was gone are only
+// still there if the channel keeps them, see -K.
+const char* checkpoint_path = NULL;
+int checkpoint_fd = -1;
+int have_checkpoint = 0;
+uint64_t checkpoint_seq;
+uint64_t checkpoint_pending; // what to save next time, see checkpoint_flush()
+int checkpoint_dirty = 0;
+
+// A message on its way to the sinks, one copy shared by both of them
+// Each sink drops its reference when it's done, the last one frees it.
+struct queued_message {
+    atomic_int refs;
+    uint64_t seq; // the driver's sequence number
+    size_t len;
+    char data[]; // the struct message_data, NUL terminated
+};
+
+// Single producer / single consumer queue of messages, one per sink
+// Only the consumer moves head and only the producer moves tail, so pushing
+// and popping never take a lock. The semaphores only come into it when the
+// consumer has nothing to do or the producer is a whole queue ahead.
+struct spsc_queue {
+    struct queued_message** slots;
+    size_t mask;                    // number of slots - 1, a power of two
+    _Alignas(64) atomic_size_t head; // next slot to pop
+    _Alignas(64) atomic_size_t tail; // next slot to push
+    sem_t items; // messages waiting
+    sem_t space; // free slots
+};
 
-char buffer[4096]; //shared buffer for data read from device
+#define QUEUE_DEFAULT_SIZE 4096 // messages a sink can fall behind by before the reader waits for it
 
-pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER; // mutex for shared buffer
-pthread_cond_t data_available = PTHREAD_COND_INITIALIZER; // conditional variable for when data is avaliable
+struct spsc_queue console_queue;
+struct spsc_queue log_queue;
 
-int string_size;
+// Set of unique hash values of recent messages, preventing duplication
+// It's an open addressing hash table (linear probing, never more than half
+// full) with room for 'window' hashes. Once it's full the oldest hash is
+// evicted to make room, and with -t hashes older than that many seconds are
+// forgotten as well, so every message costs the same however big the window.
+// With -b a Bloom filter sits in front of the table and answers "never seen"
+// for most new messages without touching the (much bigger) table.
+// Only reader_thread() uses it, so it doesn't need a lock.
+#define BLOOM_HASHES 4 // bits set per hash
 
-// Array to store unique hash values of messages, preventing duplication
-// idk what word to use other than exhausted
-int64_t exhausted_hashes[100]; 
-int hash_count = 0;
-pthread_mutex_t hash_check_mutex = PTHREAD_MUTEX_INITIALIZER; // mutex for shared buffer
+struct dedup_slot {
+    int64_t hash;
+    int used;
+};
+
+struct dedup_set {
+    struct dedup_slot* slots;
+    size_t mask;        // number of slots - 1, a power of two
+    int64_t* fifo;      // hashes in the order they were added, oldest at fifo_head
+    time_t* added;      // when each of them was added
+    size_t window;      // most hashes remembered
+    size_t fifo_head;
+    size_t count;
+    time_t max_age;     // seconds, 0 = only evict when full
+
+    // Two generations so old hashes can age out of the filter: bloom[cur]
+    // gets new hashes, bloom[!cur] has the ones before. Every hash in the
+    // window was added in the last 'window' additions, so it's in one of them.
+    uint64_t* bloom[2]; // NULL without -b
+    size_t bloom_mask;  // bits per generation - 1
+    int bloom_cur;
+    size_t bloom_added; // hashes added to bloom[cur]
+};
+
+struct dedup_set seen_hashes;
 
 //IOCTL
 void get_device_info(int fd) {
@@ -55,76 +129,439 @@ Lecture 8, Lecture 9, Lecture 10
 
 /* https://medium.com/@joshuaudayagiri/linux-system-calls-read-a9ce7ed33827 */
 
-void initialise_hash_array() {
-    for (int i = 0; i < 100; i++) {
-        exhausted_hashes[i] = -1;  // Use -1 as "empty" marker
+// https://prng.di.unimi.it/splitmix64.c
+// Spreads the bits of a hash, the writer's hashes are too regular to index with directly
+static uint64_t mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+int dedup_init(struct dedup_set* set, size_t window, time_t max_age, int use_bloom) {
+    size_t slots = 2;
+    while (slots < window * 2) { // at most half full, keeps the probe sequences short
+        slots <<= 1;
+    }
+
+    memset(set, 0, sizeof(*set));
+    set->slots = calloc(slots, sizeof(*set->slots));
+    set->fifo = calloc(window, sizeof(*set->fifo));
+    set->added = calloc(window, sizeof(*set->added));
+    set->mask = slots - 1;
+    set->window = window;
+    set->max_age = max_age;
+
+    if (use_bloom) {
+        size_t bits = 64;
+        while (bits < window * 8) { // ~2% false positives at 4 hashes
+            bits <<= 1;
+        }
+        set->bloom[0] = calloc(bits / 64, sizeof(uint64_t));
+        set->bloom[1] = calloc(bits / 64, sizeof(uint64_t));
+        set->bloom_mask = bits - 1;
+        if (!set->bloom[0] || !set->bloom[1]) {
+            return -1;
+        }
+    }
+
+    return (set->slots && set->fifo && set->added) ? 0 : -1;
+}
+
+// Slot holding hash, or the empty slot where it would go
+static size_t dedup_find(struct dedup_set* set, int64_t hash) {
+    size_t i = mix64(hash) & set->mask;
+
+    while (set->slots[i].used && set->slots[i].hash != hash) {
+        i = (i + 1) & set->mask;
+    }
+    return i;
+}
+
+// Takes hash out of the table. Later entries of the same probe run are
+// shifted back into the gap, so lookups never stop early at a hole and no
+// tombstones pile up.
+static void dedup_remove(struct dedup_set* set, int64_t hash) {
+    size_t i = dedup_find(set, hash);
+    size_t j = i;
+
+    if (!set->slots[i].used) {
+        return;
+    }
+
+    while (1) {
+        j = (j + 1) & set->mask;
+        if (!set->slots[j].used) {
+            break;
+        }
+
+        // The entry at j can fill the gap at i if i is between its home slot and j
+        size_t home = mix64(set->slots[j].hash) & set->mask;
+        if (((j - home) & set->mask) >= ((j - i) & set->mask)) {
+            set->slots[i] = set->slots[j];
+            i = j;
+        }
     }
+    set->slots[i].used = 0;
+}
+
+static void dedup_evict_oldest(struct dedup_set* set) {
+    dedup_remove(set, set->fifo[set->fifo_head]);
+    set->fifo_head = (set->fifo_head + 1) % set->window;
+    set->count--;
+}
+
+// Bit positions come from one mixed hash (h1 + k * h2), salted so they don't line up with the table's
+static int bloom_maybe_seen(struct dedup_set* set, int64_t hash) {
+    uint64_t h = mix64(hash ^ 0x9e3779b97f4a7c15ULL);
+    uint64_t h2 = (h >> 32) | 1;
+
+    for (int gen = 0; gen < 2; gen++) {
+        int all_set = 1;
+        for (int k = 0; k < BLOOM_HASHES && all_set; k++) {
+            size_t bit = (h + k * h2) & set->bloom_mask;
+            all_set = (set->bloom[gen][bit / 64] >> (bit % 64)) & 1;
+        }
+        if (all_set) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void bloom_add(struct dedup_set* set, int64_t hash) {
+    uint64_t h = mix64(hash ^ 0x9e3779b97f4a7c15ULL);
+    uint64_t h2 = (h >> 32) | 1;
+
+    // Start a new generation every 'window' hashes, the one before it is dropped
+    if (set->bloom_added == set->window) {
+        set->bloom_cur = !set->bloom_cur;
+        memset(set->bloom[set->bloom_cur], 0, (set->bloom_mask + 1) / 8);
+        set->bloom_added = 0;
+    }
+
+    for (int k = 0; k < BLOOM_HASHES; k++) {
+        size_t bit = (h + k * h2) & set->bloom_mask;
+        set->bloom[set->bloom_cur][bit / 64] |= 1ULL << (bit % 64);
+    }
+    set->bloom_added++;
 }
 
 int has_seen_hash(int64_t hash_to_check) {
-    pthread_mutex_lock(&hash_check_mutex); 
-    for (int i = 0; i < 100; i++) { // 100 = length of exhausted_hashes
-        // If the hash is found in the array, return 1
-        if (exhausted_hashes[i] == hash_to_check) {
-            printf("Read message with hash: %ld\n", ((struct message_data*)buffer)->unique_hash);
-            pthread_mutex_unlock(&hash_check_mutex); 
+    struct dedup_set* set = &seen_hashes;
+    time_t now = time(NULL);
+
+    // Forget hashes that have been around longer than -t allows
+    while (set->max_age && set->count && now - set->added[set->fifo_head] > set->max_age) {
+        dedup_evict_oldest(set);
+    }
+
+    // If the hash is in the set, return 1
+    if (!set->bloom[0] || bloom_maybe_seen(set, hash_to_check)) {
+        if (set->slots[dedup_find(set, hash_to_check)].used) {
+            printf("Read message with hash: %ld\n", hash_to_check);
             return 1;  // Message has already been printed
         }
     }
 
     // If we haven't returned yet, it meens the hash hasn't been seen
-    exhausted_hashes[hash_count] = hash_to_check; // Add the hash to the array
-    hash_count++;
+    if (set->count == set->window) {
+        dedup_evict_oldest(set); // make room
+    }
 
-    if (hash_count == 100) {
-        hash_count = 0; // Reset the array
+    size_t i = dedup_find(set, hash_to_check);
+    set->slots[i].hash = hash_to_check;
+    set->slots[i].used = 1;
+
+    size_t tail = (set->fifo_head + set->count) % set->window;
+    set->fifo[tail] = hash_to_check;
+    set->added[tail] = now;
+    set->count++;
+
+    if (set->bloom[0]) {
+        bloom_add(set, hash_to_check);
     }
 
-    pthread_mutex_unlock(&hash_check_mutex); 
     return 0;  // Hash not seen before
 }
 
+int queue_init(struct spsc_queue* q, size_t size) {
+    size_t slots = 2;
+    while (slots < size) {
+        slots <<= 1;
+    }
+
+    q->slots = calloc(slots, sizeof(*q->slots));
+    q->mask = slots - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    if (!q->slots || sem_init(&q->items, 0, 0) == -1 || sem_init(&q->space, 0, slots) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+// Producer side, waits only if the consumer is a whole queue behind
+void queue_push(struct spsc_queue* q, struct queued_message* msg) {
+    while (sem_wait(&q->space) == -1) {
+        // interrupted by a signal, try again
+    }
+
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    q->slots[tail & q->mask] = msg;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release); // publish the slot
+
+    sem_post(&q->items);
+}
+
+// Consumer side, sleeps while the queue is empty
+// Gives up and returns NULL at 'until' (CLOCK_REALTIME), or right away if
+// 'until' is zero. NULL 'until' waits for as long as it takes.
+struct queued_message* queue_pop_until(struct spsc_queue* q, const struct timespec* until) {
+    int ret;
+
+    do {
+        if (!until) {
+            ret = sem_wait(&q->items);
+        } else if (until->tv_sec == 0 && until->tv_nsec == 0) {
+            ret = sem_trywait(&q->items);
+        } else {
+            ret = sem_timedwait(&q->items, until);
+        }
+    } while (ret == -1 && errno == EINTR); // interrupted by a signal, try again
+
+    if (ret == -1) {
+        return NULL; // timed out or empty
+    }
+
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    atomic_load_explicit(&q->tail, memory_order_acquire); // pairs with the push that filled the slot
+    struct queued_message* msg = q->slots[head & q->mask];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+    sem_post(&q->space);
+    return msg;
+}
+
+struct queued_message* queue_pop(struct spsc_queue* q) {
+    return queue_pop_until(q, NULL);
+}
+
+void message_put(struct queued_message* msg) {
+    if (atomic_fetch_sub_explicit(&msg->refs, 1, memory_order_acq_rel) == 1) {
+        free(msg);
+    }
+}
+
+// Picks up from the checkpoint, and says so if messages went missing meanwhile
+// Returns the sequence number of the next message
+uint64_t resume(struct ipc_client* client) {
+    uint64_t seq = checkpoint_seq;
+
+    int err = ipc_seek(client, &seq);
+    if (err) {
+        errno = -err;
+        perror("Failed to resume from the checkpoint");
+        return seq;
+    }
+
+    if (seq == checkpoint_seq) {
+        printf("Resuming from message %llu\n", (unsigned long long)seq);
+    } else if (seq > checkpoint_seq) {
+        printf("Resuming from message %llu, the %llu before it aren't kept any more\n",
+               (unsigned long long)seq, (unsigned long long)(seq - checkpoint_seq));
+    } else {
+        printf("Message numbers started over (module reloaded?), resuming from message %llu\n",
+               (unsigned long long)seq);
+    }
+    return seq;
+}
+
 // Parent thread continuously reads data from the device
-// Parent thread continuously reads data from the device
+// Each read() returns a batch of framed messages, which get handed to the
+// console and log threads one at a time. Every message is numbered, so a gap
+// in the numbers means something got lost on the way.
+// The batch buffer starts out as big as the ring, so any record fits, and
+// grows if the ring is resized past it.
 void* reader_thread(void* arg) {
-    int fd = open(DEVICE_PATH, O_RDONLY);
-    if (fd == -1) {
+    char* batch; // records straight from the device
+    size_t batch_size = 4096;
+    uint64_t expected = 0; // sequence number of the next message
+    int have_expected = 0;
+
+    struct ipc_client* client = ipc_open(device_path, IPC_READ, backend);
+    if (!client) {
         perror("Failed to open device");
         return NULL;
     }
 
+    int ring_size = ipc_ring_size(client);
+    if (ring_size > 0 && (size_t)ring_size > batch_size) {
+        batch_size = ring_size;
+    }
+    batch = malloc(batch_size);
+    if (!batch) {
+        perror("Failed to allocate the read buffer");
+        ipc_close(client);
+        return NULL;
+    }
+
+    if (have_checkpoint) {
+        expected = resume(client);
+        have_expected = 1;
+    }
+
     while (1) {
-        ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
+        ssize_t bytes_read = ipc_recv_batch(client, batch, batch_size);
+
+        if (bytes_read == -EMSGSIZE) {
+            // The next record is bigger than the buffer, the ring must have grown
+            char* bigger = realloc(batch, batch_size * 2);
+            if (!bigger) {
+                perror("Failed to grow the read buffer");
+                exit(1);
+            }
+            batch = bigger;
+            batch_size *= 2;
+            continue;
+        }
+        if (bytes_read == 0 || bytes_read == -EINTR || bytes_read == -EAGAIN) {
+            continue; // nothing yet, read again
+        }
+        if (bytes_read == -EBADMSG) {
+            // The driver skipped past them, the sequence check reports the gap
+            printf("Skipped messages that couldn't be decrypted\n");
+            continue;
+        }
+        if (bytes_read < 0) {
+            fprintf(stderr, "Read failed: %s\n", strerror(-bytes_read));
+            exit(1); // ring is corrupt or the device went away, retrying won't help
+        }
 
-        if (bytes_read > 0) {
-            pthread_mutex_lock(&buffer_mutex);
-            struct message_data* msg = (struct message_data*)buffer;
+        size_t pos = 0;
+        size_t len;
+        char* record;
+
+        while ((record = ipc_next_record(batch, bytes_read, &pos, &len)) != NULL) {
+            uint64_t seq = ipc_record_seq(record);
+
+            if (have_expected && seq > expected) {
+                printf("Missed %llu messages before message %llu\n",
+                       (unsigned long long)(seq - expected), (unsigned long long)seq);
+            }
+            expected = seq + 1;
+            have_expected = 1;
+
+            if (len < sizeof(struct message_data)) {
+                continue; // not one of ours
+            }
+
+            struct message_data* msg = (struct message_data*)record;
             printf("Received message with hash: %ld\n", msg->unique_hash);
 
-            if (!has_seen_hash(msg->unique_hash)) {
-                pthread_cond_broadcast(&data_available);
+            if (has_seen_hash(msg->unique_hash)) {
+                continue;
             }
-            pthread_mutex_unlock(&buffer_mutex);
-        }
 
-        sleep(1);
+            // One copy for both sinks
+            struct queued_message* copy = malloc(sizeof(*copy) + len + 1);
+            if (!copy) {
+                perror("Failed to copy message");
+                continue;
+            }
+            atomic_init(&copy->refs, 2);
+            copy->seq = seq;
+            copy->len = len;
+            memcpy(copy->data, record, len);
+            copy->data[len] = '\0'; // message text isn't terminated on the wire
+
+            queue_push(&console_queue, copy);
+            queue_push(&log_queue, copy);
+        }
     }
 
-    close(fd);
+    free(batch);
+    ipc_close(client);
     return NULL;
 }
 
+// -K: how many recent messages the channel should hold on to for us
+void set_retention(uint32_t messages) {
+    struct ipc_client* client = ipc_open(device_path, IPC_WRITE, backend);
+    if (!client) {
+        perror("Failed to open device for writing");
+        return;
+    }
+
+    int err = ipc_set_retention(client, messages, 0);
+    if (err) {
+        errno = -err;
+        perror("Failed to set retention");
+    } else {
+        printf("IOCTL: Channel keeps the last %u messages\n", messages);
+    }
+
+    ipc_close(client);
+}
+
+// Opens (or creates) the -C file and reads where the last run got to
+int checkpoint_open(void) {
+    char text[32];
+
+    checkpoint_fd = open(checkpoint_path, O_RDWR | O_CREAT, 0644);
+    if (checkpoint_fd == -1) {
+        perror("Failed to open the checkpoint");
+        return -1;
+    }
+
+    ssize_t n = pread(checkpoint_fd, text, sizeof(text) - 1, 0);
+    if (n > 0) {
+        text[n] = '\0';
+        have_checkpoint = sscanf(text, "%llu", (unsigned long long*)&checkpoint_seq) == 1;
+    }
+    return 0;
+}
+
+// Records that everything before message 'next' is in the log. Always the
+// same width, so it can overwrite the last one in place.
+void checkpoint_save(uint64_t next) {
+    char text[32];
+    int n = snprintf(text, sizeof(text), "%020llu\n", (unsigned long long)next);
+
+    if (pwrite(checkpoint_fd, text, n, 0) != n) {
+        perror("Failed to write the checkpoint");
+    }
+}
+
+// Saves the latest batch's checkpoint, call once the log itself is as far
+// along (synced, if sync is set)
+void checkpoint_flush(int sync) {
+    if (checkpoint_fd == -1 || !checkpoint_dirty) {
+        return;
+    }
+    checkpoint_save(checkpoint_pending);
+    checkpoint_dirty = 0;
+    if (sync) {
+        fdatasync(checkpoint_fd);
+    }
+}
+
 void set_shm_size(int new_size) {
-    int fd = open(DEVICE_PATH, O_WRONLY);
-    if (fd == -1) {
+    struct ipc_client* client = ipc_open(device_path, IPC_WRITE, backend);
+    if (!client) {
         perror("Failed to open device for writing");
         return;
     }
 
-    ioctl(fd, IOCTL_SET_SHM_SIZE, &new_size);
-    printf("IOCTL: Shared memory size set to %d \n", new_size);
+    // EBUSY while someone has the ring mapped, ENOSPC if the queued messages wouldn't fit
+    int err = ipc_set_ring_size(client, new_size);
+    if (err) {
+        errno = -err;
+        perror("Failed to set shared memory size");
+    } else {
+        printf("IOCTL: Shared memory size set to %d \n", new_size);
+    }
 
-    close(fd);
+    ipc_close(client);
 }
 
 
@@ -132,60 +569,527 @@ void set_shm_size(int new_size) {
 // Console writer thread prints data to console
 void* console_writer_thread(void* arg) {
     while (1) {
-        pthread_mutex_lock(&buffer_mutex);
-        pthread_cond_wait(&data_available, &buffer_mutex);
-
-        struct message_data* msg = (struct message_data*)buffer;
+        struct queued_message* copy = queue_pop(&console_queue);
+        struct message_data* msg = (struct message_data*)copy->data;
 
         printf("|| Console | %d | Writer PID: %d || %s\n",
                msg->timestamp, msg->writer_pid, msg->message);
 
-        pthread_mutex_unlock(&buffer_mutex);
+        message_put(copy);
     }
     return NULL;
 }
 
 /* https://community.ptc.com/t5/Customization/Write-log-file/td-p/642638 */
 
+// LOG FILE
+// The log thread group-commits: it takes everything waiting in its queue and
+// writes it with one writev() that points straight at the queued messages,
+// instead of one write per message. When that happens, and when the log gets
+// fsync()ed, is up to the policies below (-F and -S), each one of:
+//   always  after every batch, a batch being whatever was queued at the time
+//   <N>ms   once the oldest unwritten (unsynced) message is N ms old
+//   <N>kb   once N KB are waiting
+//   never   writes only when the batch is full, never fsyncs
+// With -R the log is rotated once it's bigger than that many MB.
+//
+// With -L <dir> the log is binary instead (see ipc_log.h): each message is
+// appended as it came from the device, into numbered segments in dir, with
+// a sparse index next to each one for ipc_logq. A segment is closed once it
+// passes -R MB (default 64) and the reader starts a fresh one every time it
+// starts. Old segments are kept, nothing is deleted. Only the .log is
+// fsync()ed, the index can always be rebuilt from it.
+enum log_policy_kind { POLICY_ALWAYS, POLICY_MS, POLICY_KB, POLICY_NEVER };
+
+struct log_policy {
+    enum log_policy_kind kind;
+    long amount; // ms or KB
+};
+
+struct log_policy flush_policy = { POLICY_ALWAYS, 0 };
+struct log_policy sync_policy = { POLICY_NEVER, 0 };
+long long rotate_bytes = 0; // 0 = never rotate
+const char* binlog_dir = NULL; // NULL = text log
+
+#define BINLOG_SEGMENT_DEFAULT (64LL * 1024 * 1024)
+
+// The binary segment being written
+struct binlog_state {
+    unsigned segment;          // number in the file names
+    int idx_fd;
+    unsigned long long offset; // where the next record goes, counting ones still in the batch
+    struct ipc_log_index block; // the block being filled
+};
+
+struct binlog_state binlog = { 0, -1, 0, { 0 } };
+
+#define LOG_BATCH_MESSAGES 256 // 3 iovecs each, stays under IOV_MAX (1024)
+#define LOG_HEADER_SIZE 64
+
+struct log_batch {
+    struct iovec iov[LOG_BATCH_MESSAGES * 3];
+    char headers[LOG_BATCH_MESSAGES][LOG_HEADER_SIZE];
+    struct queued_message* held[LOG_BATCH_MESSAGES]; // pointed to by iov until written
+    int count;
+    size_t bytes;
+    long long first_ms; // when the oldest message in the batch came in
+
+    // Binary log only: index entries for blocks finished in this batch,
+    // written after the records so the index never gets ahead of the .log
+    struct ipc_log_index blocks[LOG_BATCH_MESSAGES / IPC_LOG_BLOCK + 1];
+    int block_count;
+};
+
+int parse_policy(const char* text, struct log_policy* policy) {
+    char* end;
+
+    if (strcmp(text, "always") == 0) {
+        policy->kind = POLICY_ALWAYS;
+        return 0;
+    }
+    if (strcmp(text, "never") == 0) {
+        policy->kind = POLICY_NEVER;
+        return 0;
+    }
+
+    policy->amount = strtol(text, &end, 10);
+    if (policy->amount <= 0) {
+        return -1;
+    }
+    if (strcmp(end, "ms") == 0) {
+        policy->kind = POLICY_MS;
+    } else if (strcmp(end, "kb") == 0) {
+        policy->kind = POLICY_KB;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Whether a policy says it's time, given how long the oldest pending byte
+// has waited and how many are pending
+static int policy_due(const struct log_policy* policy, long long waited_ms, size_t pending) {
+    if (pending == 0) {
+        return 0;
+    }
+    switch (policy->kind) {
+        case POLICY_ALWAYS: return 1;
+        case POLICY_MS: return waited_ms >= policy->amount;
+        case POLICY_KB: return pending >= (size_t)policy->amount * 1024;
+        default: return 0;
+    }
+}
+
+// Binary log: record header, the message as it came from the device, padding
+static void batch_add_binary(struct log_batch* batch, struct queued_message* copy) {
+    static const char padding[IPC_LOG_ALIGN];
+    struct message_data* msg = (struct message_data*)copy->data;
+    struct iovec* iov = &batch->iov[batch->count * 3];
+    struct ipc_log_record* record = (struct ipc_log_record*)batch->headers[batch->count];
+    struct ipc_log_index* block = &binlog.block;
+    size_t size = IPC_LOG_RECORD_SIZE(copy->len);
+
+    record->len = copy->len;
+    record->reserved = 0;
+    iov[0].iov_base = record;
+    iov[0].iov_len = sizeof(*record);
+    iov[1].iov_base = copy->data;
+    iov[1].iov_len = copy->len;
+    iov[2].iov_base = (void*)padding;
+    iov[2].iov_len = size - sizeof(*record) - copy->len;
+
+    if (block->count == 0) {
+        block->offset = binlog.offset;
+        block->min_time = msg->timestamp;
+        block->max_time = msg->timestamp;
+        block->pid_mask = 0;
+    }
+    if (msg->timestamp < block->min_time) {
+        block->min_time = msg->timestamp;
+    }
+    if (msg->timestamp > block->max_time) {
+        block->max_time = msg->timestamp;
+    }
+    block->pid_mask |= 1ULL << ((unsigned)msg->writer_pid % 64);
+    block->count++;
+
+    if (block->count == IPC_LOG_BLOCK) {
+        batch->blocks[batch->block_count++] = *block;
+        block->count = 0;
+    }
+
+    binlog.offset += size;
+    batch->held[batch->count++] = copy;
+    batch->bytes += size;
+}
+
+static void batch_add(struct log_batch* batch, struct queued_message* copy) {
+    struct message_data* msg = (struct message_data*)copy->data;
+    struct iovec* iov = &batch->iov[batch->count * 3];
+    char* header = batch->headers[batch->count];
+
+    if (batch->count == 0) {
+        batch->first_ms = now_ms();
+    }
+
+    if (binlog_dir) {
+        batch_add_binary(batch, copy);
+        return;
+    }
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = snprintf(header, LOG_HEADER_SIZE, "|| Log | %d | Writer PID: %d || ",
+                              (int)msg->timestamp, msg->writer_pid);
+    iov[1].iov_base = msg->message;
+    iov[1].iov_len = strlen(msg->message);
+    iov[2].iov_base = "\n";
+    iov[2].iov_len = 1;
+
+    batch->held[batch->count++] = copy;
+    batch->bytes += iov[0].iov_len + iov[1].iov_len + 1;
+}
+
+// writev() until everything is out, regular files can still do short writes
+static int writev_all(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Writes the batch out and lets go of its messages
+static void batch_write(struct log_batch* batch, int fd) {
+    if (writev_all(fd, batch->iov, batch->count * 3) == -1) {
+        perror("Failed to write the log");
+    } else if (checkpoint_fd != -1 && batch->count > 0) {
+        checkpoint_pending = batch->held[batch->count - 1]->seq + 1; // they're queued in order
+        checkpoint_dirty = 1;
+        if (sync_policy.kind == POLICY_NEVER) {
+            checkpoint_flush(0); // nothing to wait for
+        }
+    }
+
+    if (batch->block_count > 0 &&
+        write(binlog.idx_fd, batch->blocks, batch->block_count * sizeof(batch->blocks[0])) == -1) {
+        perror("Failed to write the log index");
+    }
+
+    for (int i = 0; i < batch->count; i++) {
+        message_put(batch->held[i]);
+    }
+    batch->count = 0;
+    batch->bytes = 0;
+    batch->block_count = 0;
+}
+
+// Highest segment number already in the binary log directory, 0 if none
+static unsigned last_segment(void) {
+    unsigned last = 0, number;
+    struct dirent* entry;
+    DIR* dir = opendir(binlog_dir);
+
+    if (!dir) {
+        return 0;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "seg-%u.log", &number) == 1 && number > last) {
+            last = number;
+        }
+    }
+    closedir(dir);
+    return last;
+}
+
+// Starts the next binary segment: a new .log with its header, and an empty .idx
+static int open_segment(void) {
+    char path[512];
+    struct ipc_log_segment_hdr hdr;
+
+    if (binlog.segment == 0) {
+        mkdir(binlog_dir, 0755); // fine if it's there already
+        binlog.segment = last_segment();
+    }
+    binlog.segment++;
+
+    snprintf(path, sizeof(path), "%s/seg-%08u.log", binlog_dir, binlog.segment);
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+    if (fd == -1) {
+        perror("failed to open log segment");
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IPC_LOG_MAGIC, sizeof(hdr.magic));
+    hdr.version = 1;
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        perror("failed to write log segment header");
+        close(fd);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/seg-%08u.idx", binlog_dir, binlog.segment);
+    binlog.idx_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (binlog.idx_fd == -1) {
+        perror("failed to open log index");
+        close(fd);
+        return -1;
+    }
+
+    binlog.offset = sizeof(hdr);
+    binlog.block.count = 0;
+    return fd;
+}
+
+int open_log(void) {
+    if (binlog_dir) {
+        return open_segment();
+    }
+
+    int fd = open(LOG_FILE_PATH, O_WRONLY | O_CREAT | O_APPEND, 0644); //open log file in append mode
+    if (fd == -1) {
+        perror("failed to open log file");
+    }
+    return fd;
+}
+
+// reader_log.txt becomes reader_log.txt.1, .1 becomes .2 and so on, the oldest goes
+// A binary segment is closed off (with an index entry for its last, partial
+// block) and the next one started instead.
+// Only called right after a batch was written, so every record is in the file.
+int rotate_log(int fd) {
+    char from[256], to[256];
+
+    if (sync_policy.kind != POLICY_NEVER) {
+        fdatasync(fd); // keep the promise for what's in there already
+        checkpoint_flush(1);
+    }
+    close(fd);
+
+    if (binlog_dir) {
+        if (binlog.block.count > 0 &&
+            write(binlog.idx_fd, &binlog.block, sizeof(binlog.block)) == -1) {
+            perror("Failed to write the log index");
+        }
+        close(binlog.idx_fd);
+        return open_segment();
+    }
+
+    for (int i = LOG_KEEP - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", LOG_FILE_PATH, i);
+        snprintf(to, sizeof(to), "%s.%d", LOG_FILE_PATH, i + 1);
+        rename(from, to); // fails harmlessly if there aren't that many yet
+    }
+    snprintf(to, sizeof(to), "%s.1", LOG_FILE_PATH);
+    rename(LOG_FILE_PATH, to);
+
+    return open_log();
+}
+
+// How long the log thread may sleep before a policy comes due, as a
+// CLOCK_REALTIME deadline for sem_timedwait(). NULL if only a new message can make one due.
+static const struct timespec* next_deadline(struct timespec* until, const struct log_batch* batch,
+                                            size_t unsynced, long long unsynced_ms) {
+    long long due = -1;
+
+    if (flush_policy.kind == POLICY_MS && batch->count > 0) {
+        due = batch->first_ms + flush_policy.amount;
+    }
+    if (sync_policy.kind == POLICY_MS && unsynced > 0 && (due == -1 || unsynced_ms + sync_policy.amount < due)) {
+        due = unsynced_ms + sync_policy.amount;
+    }
+    if (due == -1) {
+        return NULL;
+    }
+
+    long long wait = due - now_ms();
+    if (wait < 1) {
+        wait = 1;
+    }
+    clock_gettime(CLOCK_REALTIME, until);
+    until->tv_sec += wait / 1000;
+    until->tv_nsec += (wait % 1000) * 1000000;
+    if (until->tv_nsec >= 1000000000) {
+        until->tv_sec++;
+        until->tv_nsec -= 1000000000;
+    }
+    return until;
+}
+
 // Log writer thread: Writes data to a log file
 void* log_writer_thread(void* arg) {
-    FILE* log_file = fopen(LOG_FILE_PATH, "a"); //open log file in append mode
-    if (log_file == NULL) {
-        perror("failed to open log file");
+    static struct log_batch batch;
+    struct timespec until;
+    const struct timespec now = { 0, 0 };
+    size_t unsynced = 0;       // bytes written since the last fsync
+    long long unsynced_ms = 0; // when the first of them was written
+    long long file_bytes;
+    struct stat st;
+
+    int fd = open_log();
+    if (fd == -1) {
         return NULL;
     }
+    file_bytes = fstat(fd, &st) == 0 ? st.st_size : 0;
+    if (binlog_dir && rotate_bytes == 0) {
+        rotate_bytes = BINLOG_SEGMENT_DEFAULT; // segments get mmap'd whole by ipc_logq
+    }
 
     while (1) {
-        pthread_mutex_lock(&buffer_mutex); 
-        pthread_cond_wait(&data_available, &buffer_mutex);  
+        struct queued_message* copy = queue_pop_until(&log_queue, next_deadline(&until, &batch, unsynced, unsynced_ms));
 
-        struct message_data* msg = (struct message_data*)buffer;
-
-        fprintf(
-            log_file,
-            "|| Log | %d | Writer PID: %d || %s\n",
-            msg->timestamp, msg->writer_pid, msg->message
-        );
+        // Group commit: take whatever else is already waiting along with it
+        while (copy) {
+            batch_add(&batch, copy);
+            copy = batch.count < LOG_BATCH_MESSAGES ? queue_pop_until(&log_queue, &now) : NULL;
+        }
 
-        /* https://how.dev/answers/what-is-fflush-in-c */
+        long long t = now_ms();
+        if (batch.count == LOG_BATCH_MESSAGES || policy_due(&flush_policy, t - batch.first_ms, batch.bytes)) {
+            if (unsynced == 0) {
+                unsynced_ms = t;
+            }
+            unsynced += batch.bytes;
+            file_bytes += batch.bytes;
+            batch_write(&batch, fd);
+        }
 
-        fflush(log_file);  // immediately write to the log file/disk
+        if (policy_due(&sync_policy, t - unsynced_ms, unsynced)) {
+            fdatasync(fd);
+            checkpoint_flush(1); // only after the log, so it never points past what's on disk
+            unsynced = 0;
+        }
 
-        pthread_mutex_unlock(&buffer_mutex);
+        if (rotate_bytes && file_bytes >= rotate_bytes) {
+            fd = rotate_log(fd);
+            if (fd == -1) {
+                return NULL;
+            }
+            file_bytes = 0;
+            unsynced = 0;
+        }
     }
 
-    fclose(log_file);
+    close(fd);
     return NULL; // exits
 }
 
 int main(int argc, char* argv[]) {
-    initialise_hash_array(); // Initialise the hash array
+    const char* program = argv[0];
+    size_t window = 1024; // how many recent hashes to remember
+    time_t max_age = 0;
+    int use_bloom = 0;
+    size_t queue_size = QUEUE_DEFAULT_SIZE;
+    long retain = -1;
+    int bad_args = 0;
+
+    // Options come first:
+    //   -d /dev/ipc_device1   reads another channel instead of /dev/ipc_device
+    //   -w 1000000            remembers that many hashes for dedup (default 1024)
+    //   -t 60                 forgets hashes after that many seconds
+    //   -b                    puts a Bloom filter in front of the dedup table
+    //   -q 65536              lets each sink fall that many messages behind (default 4096)
+    //   -F 10ms               when the log gets written: always, <N>ms, <N>kb or never (default always)
+    //   -S 1000ms             when the log gets fsync()ed, same choices (default never)
+    //   -R 64                 rotates the log once it passes that many MB
+    //   -L /var/log/ipc       writes a binary log into that directory instead, see ipc_logq
+    //   -U                    reads the shared memory ring even if the module is loaded, see ipc_client.h
+    //   -C /var/lib/ipc/seq   keeps track of what's been logged there and picks up from it after a restart
+    //   -K 100000             asks the channel to keep the last that many messages for when we restart
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-b") == 0) {
+            use_bloom = 1;
+            argv++;
+            argc--;
+            continue;
+        }
+        if (strcmp(argv[1], "-U") == 0) {
+            backend = IPC_BACKEND_SHM;
+            argv++;
+            argc--;
+            continue;
+        }
+
+        if (argc > 2 && strcmp(argv[1], "-d") == 0) {
+            device_path = argv[2];
+        } else if (argc > 2 && strcmp(argv[1], "-w") == 0) {
+            window = strtoul(argv[2], NULL, 10);
+        } else if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+            max_age = atol(argv[2]);
+        } else if (argc > 2 && strcmp(argv[1], "-q") == 0) {
+            queue_size = strtoul(argv[2], NULL, 10);
+        } else if (argc > 2 && strcmp(argv[1], "-F") == 0) {
+            bad_args |= parse_policy(argv[2], &flush_policy);
+        } else if (argc > 2 && strcmp(argv[1], "-S") == 0) {
+            bad_args |= parse_policy(argv[2], &sync_policy);
+        } else if (argc > 2 && strcmp(argv[1], "-R") == 0) {
+            rotate_bytes = atoll(argv[2]) * 1024 * 1024;
+        } else if (argc > 2 && strcmp(argv[1], "-L") == 0) {
+            binlog_dir = argv[2];
+        } else if (argc > 2 && strcmp(argv[1], "-C") == 0) {
+            checkpoint_path = argv[2];
+        } else if (argc > 2 && strcmp(argv[1], "-K") == 0) {
+            retain = atol(argv[2]);
+        } else {
+            bad_args = 1; // unknown option
+            break;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (bad_args || window == 0 || max_age < 0 || queue_size == 0 || retain < -1 || retain > UINT32_MAX || argc > 2) {
+        printf("Expected format: %s [-d device] [-w window] [-t seconds] [-b] [-q queue size]\n"
+               "                       [-F always|<N>ms|<N>kb|never] [-S always|<N>ms|<N>kb|never] [-R MB] [-L dir] [-U]\n"
+               "                       [-C file] [-K messages] [shm size]\n", program);
+        return 1;
+    }
+
+    if (dedup_init(&seen_hashes, window, max_age, use_bloom) == -1) {
+        perror("Failed to allocate the dedup window");
+        return -1;
+    }
+
+    if (queue_init(&console_queue, queue_size) == -1 || queue_init(&log_queue, queue_size) == -1) {
+        perror("Failed to set up the sink queues");
+        return -1;
+    }
+
+    if (checkpoint_path && checkpoint_open() == -1) {
+        return -1;
+    }
+
     // takes input from the console to set the shm. example: sudo ./reader 1024
     if (argc == 2) {
         int new_size = atoi(argv[1]); //converts from string to int
         set_shm_size(new_size); //callin ioctl to set custom shm
     }
 
+    if (retain != -1) {
+        set_retention(retain);
+    }
+
     pthread_t reader_tid, console_writer_tid, log_writer_tid; //thread identifiers
 
     // Start the threads
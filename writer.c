@@ -8,105 +8,551 @@
 #include <string.h>  // String manipulation
 #include <sys/ioctl.h> // For accessing ioctl shtuff
 #include<time.h> //for readable time
+#include <sys/mman.h> // mmap() for the zero-copy path
+#include <poll.h> // waiting for room in the ring, and checking for more input
+#include <errno.h>
 #include "message.h"
+#include "ipc_client.h" // libipc, the device or its shared memory stand-in
+#include <stddef.h> // offsetof()
+#include <stdint.h>
 
-#define DEVICE_PATH "/dev/ipc_device"
-
-// Defining the ioctl functions
-#define IOCTL_GET_SHM_SIZE _IOR(42, 0, int)
+// The driver finds unique_hash here when it drops duplicates
+_Static_assert(offsetof(struct message_data, unique_hash) == IPC_DEDUP_HASH_OFFSET, "unique_hash moved, update IPC_DEDUP_HASH_OFFSET");
 
 /* https://www.geeksforgeeks.org/command-line-arguments-in-c-cpp/ */
 
+// Installs the cipher described by spec, which is one of
+// none, legacy, aes:<hex key> or chacha:<hex key>
+// Only the driver encrypts, there's nothing to set with shared memory.
+int set_key(int fd, const char *spec) {
+    struct ipc_key key;
+    const char *hex = strchr(spec, ':');
+    size_t name_len = hex ? (size_t)(hex - spec) : strlen(spec);
+
+    memset(&key, 0, sizeof(key));
+
+    if (fd == -1) {
+        printf("ERROR: Keys need the kernel module.\n");
+        return -1;
+    }
+
+    if (name_len == 4 && strncmp(spec, "none", 4) == 0) {
+        key.cipher = IPC_CIPHER_NONE;
+    } else if (name_len == 6 && strncmp(spec, "legacy", 6) == 0) {
+        key.cipher = IPC_CIPHER_LEGACY;
+    } else if (name_len == 3 && strncmp(spec, "aes", 3) == 0) {
+        key.cipher = IPC_CIPHER_AES_GCM;
+    } else if (name_len == 6 && strncmp(spec, "chacha", 6) == 0) {
+        key.cipher = IPC_CIPHER_CHACHA20_POLY1305;
+    } else {
+        printf("ERROR: Unknown cipher '%s'.\n", spec);
+        return -1;
+    }
+
+    if (hex) {
+        hex++;
+        while (hex[0] && hex[1] && key.key_len < IPC_KEY_MAX) {
+            unsigned int byte;
+            if (sscanf(hex, "%2x", &byte) != 1) {
+                printf("ERROR: Key must be hex.\n");
+                return -1;
+            }
+            key.key[key.key_len++] = byte;
+            hex += 2;
+        }
+    }
+
+    int ret = ioctl(fd, IOCTL_SET_KEY, &key);
+    memset(&key, 0, sizeof(key)); // don't keep the key around
+    if (ret == -1) {
+        perror("Failed to set key");
+        return -1;
+    }
+    return 0;
+}
+
+// Turns the driver's compression on or off for the channel, spec is lz4 or none
+// Messages pushed through the mapping (-m) are never compressed.
+int set_compress(int fd, const char *spec) {
+    int mode;
 
-// http://www.cse.yorku.ca/~oz/hash.html
-// Hashes a provided string
-int64_t hash(unsigned char *str)
-{
-    int64_t hash = 5381;
-    int c;
+    if (fd == -1) {
+        printf("ERROR: Compression needs the kernel module.\n");
+        return -1;
+    }
 
-    while (c = *str++)
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    if (strcmp(spec, "lz4") == 0) {
+        mode = IPC_COMPRESS_LZ4;
+    } else if (strcmp(spec, "none") == 0) {
+        mode = IPC_COMPRESS_NONE;
+    } else {
+        printf("ERROR: Unknown compression '%s'.\n", spec);
+        return -1;
+    }
 
-    return hash;
+    if (ioctl(fd, IOCTL_SET_COMPRESS, &mode) == -1) {
+        perror("Failed to set compression");
+        return -1;
+    }
+    return 0;
+}
+
+// STREAM MODE (-i)
+// Reads messages from a file or stdin, one per line or (with -z) each as a
+// 32-bit length followed by that many bytes, and writes them over one open
+// channel. Messages are packed into a single buffer allocated up front and
+// handed over IPC_BATCH_MAX at a time with ipc_send_batch() (or pushed into
+// the mapped ring with -m), so nothing is allocated per message. Whatever is
+// batched gets written as soon as the input has nothing more ready, so a slow
+// pipeline isn't held back waiting for a full batch.
+#define STREAM_BUFFER_SIZE (1 << 20) // at least, it's made big enough for the largest message
+#define INPUT_IDLE 2 // input_next(): nothing ready yet
+
+struct input {
+    int fd;
+    int length_delimited; // -z
+    size_t max_len;       // longest message we'll take
+    char *buf;
+    size_t size, start, end; // unread input is buf[start..end)
+    int eof;
+};
+
+struct stream_batch {
+    char *buf; // the messages, each a struct message_data and its text
+    size_t size, used;
+    struct ipc_batch_entry entries[IPC_BATCH_MAX];
+    unsigned count;
+    unsigned long long written, failed;
+};
+
+// Next message in the input, pointing into its buffer until the next call
+// Returns 1, 0 at the end of the input, -1 on an error, or INPUT_IDLE if
+// may_block isn't set and getting the message would mean waiting.
+int input_next(struct input *in, const char **text, size_t *len, int may_block) {
+    while (1) {
+        char *data = in->buf + in->start;
+        size_t avail = in->end - in->start;
+        size_t need;
+
+        if (in->length_delimited) {
+            uint32_t n = 0;
+
+            if (avail >= sizeof(n)) {
+                memcpy(&n, data, sizeof(n));
+                if (n > in->max_len) {
+                    fprintf(stderr, "ERROR: %u byte message is bigger than the ring.\n", n);
+                    return -1;
+                }
+                if (avail - sizeof(n) >= n) {
+                    *text = data + sizeof(n);
+                    *len = n;
+                    in->start += sizeof(n) + n;
+                    return 1;
+                }
+            }
+            need = sizeof(n) + n;
+        } else {
+            char *newline = memchr(data, '\n', avail);
+
+            if (newline) {
+                *text = data;
+                *len = newline - data;
+                in->start += *len + 1;
+                return 1;
+            }
+            if (in->eof && avail > 0) { // last line without a newline
+                *text = data;
+                *len = avail;
+                in->start = in->end;
+                return 1;
+            }
+            if (avail > in->max_len) {
+                fprintf(stderr, "ERROR: Line is bigger than the ring.\n");
+                return -1;
+            }
+            need = avail + 1;
+        }
+
+        if (in->eof) {
+            if (avail > 0) {
+                fprintf(stderr, "ERROR: Input ends halfway through a message.\n");
+            }
+            return 0;
+        }
+
+        // Make room for the rest of the message
+        if (in->start > 0) {
+            memmove(in->buf, data, avail);
+            in->start = 0;
+            in->end = avail;
+        }
+        if (need > in->size) {
+            size_t size = in->size * 2 > need ? in->size * 2 : need;
+            char *buf = realloc(in->buf, size);
+            if (!buf) {
+                perror("Failed to grow the input buffer");
+                return -1;
+            }
+            in->buf = buf;
+            in->size = size;
+        }
+
+        if (!may_block) {
+            struct pollfd pfd = { .fd = in->fd, .events = POLLIN };
+            if (poll(&pfd, 1, 0) == 0) {
+                return INPUT_IDLE;
+            }
+        }
+
+        ssize_t got = read(in->fd, in->buf + in->end, in->size - in->end);
+        if (got == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to read input");
+            return -1;
+        }
+        if (got == 0) {
+            in->eof = 1;
+        }
+        in->end += got;
+    }
+}
+
+// Waits until the device says there's room in the ring again
+void wait_for_room(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    poll(&pfd, 1, 1000); // the timeout only matters if a wakeup got lost
+}
+
+// Writes out everything in the batch, waiting for room whenever the ring is full
+// Messages the driver refuses for good (e.g. too big) are counted as failed.
+int stream_flush(struct ipc_client *client, struct ipc_ring_ctrl *ring, struct stream_batch *batch) {
+    int fd = ipc_fd(client);
+
+    if (!ring) {
+        long written = ipc_send_batch(client, batch->entries, batch->count);
+        if (written < 0) {
+            errno = -written;
+            perror("Write failed");
+            return -1;
+        }
+    }
+
+    for (unsigned done = 0; ring && done < batch->count; ) {
+        // Push into the mapping ourselves, one wakeup for the whole batch
+        struct ipc_batch_entry *entry = &batch->entries[done];
+        int err = ipc_ring_push(ring, (void *)(uintptr_t)entry->data, entry->len);
+        if (err == -EAGAIN) {
+            ioctl(fd, IOCTL_RING_NOTIFY); // let readers drain what's there
+            wait_for_room(fd);
+            continue;
+        }
+        entry->status = err ? err : (int)entry->len;
+        done++;
+    }
+
+    if (ring) {
+        ioctl(fd, IOCTL_RING_NOTIFY); // wake readers blocked in read()/poll()
+    }
+
+    for (unsigned i = 0; i < batch->count; i++) {
+        if (batch->entries[i].status >= 0) {
+            batch->written++;
+        } else {
+            if (batch->failed++ == 0) {
+                fprintf(stderr, "Write failed: %s\n", strerror(-batch->entries[i].status));
+            }
+        }
+    }
+    batch->count = 0;
+    batch->used = 0;
+    return 0;
+}
+
+static double elapsed(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Keeps to 'rate' messages per second: sleeps until message n is due
+// Anything batched is written first, so it isn't held back by the sleep.
+int pace(struct ipc_client *client, struct ipc_ring_ctrl *ring, struct stream_batch *batch,
+         const struct timespec *start, long rate, unsigned long long n) {
+    unsigned long long due_ns = n * 1000000000ULL / rate;
+    struct timespec due = {
+        .tv_sec = start->tv_sec + due_ns / 1000000000ULL,
+        .tv_nsec = start->tv_nsec + due_ns % 1000000000ULL,
+    };
+    if (due.tv_nsec >= 1000000000) {
+        due.tv_sec++;
+        due.tv_nsec -= 1000000000;
+    }
+
+    if (elapsed(start) * 1e9 >= due_ns) {
+        return 0; // behind or on time
+    }
+    if (batch->count > 0 && stream_flush(client, ring, batch) == -1) {
+        return -1;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {
+        // interrupted by a signal, keep sleeping
+    }
+    return 0;
+}
+
+// Writes every message in input_path ("-" for stdin) and reports how fast it went
+int stream_messages(struct ipc_client *client, struct ipc_ring_ctrl *ring, int shm_size, const char *input_path,
+                    int length_delimited, long rate) {
+    static struct stream_batch batch;
+    struct input in = { .fd = 0, .length_delimited = length_delimited, .max_len = shm_size };
+    struct timespec start;
+    const char *text;
+    size_t len;
+    pid_t pid = getpid();
+    int ret, retval = 0;
+    unsigned long long n = 0;
+
+    if (strcmp(input_path, "-") != 0) {
+        in.fd = open(input_path, O_RDONLY);
+        if (in.fd == -1) {
+            perror("Failed to open input");
+            return -1;
+        }
+    }
+
+    batch.size = STREAM_BUFFER_SIZE;
+    if (batch.size < sizeof(struct message_data) + shm_size + 8) {
+        batch.size = sizeof(struct message_data) + shm_size + 8;
+    }
+    batch.buf = malloc(batch.size);
+    in.size = 64 * 1024;
+    in.buf = malloc(in.size);
+    if (!batch.buf || !in.buf) {
+        perror("Failed to allocate the stream buffers");
+        retval = -1;
+        goto out;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while ((ret = input_next(&in, &text, &len, batch.count == 0)) != 0) {
+        if (ret == -1) {
+            retval = -1;
+            break;
+        }
+        if (ret == INPUT_IDLE) { // nothing more for now, don't sit on what we have
+            if (stream_flush(client, ring, &batch) == -1) {
+                retval = -1;
+                break;
+            }
+            continue;
+        }
+
+        size_t size = (sizeof(struct message_data) + len + 7) & ~(size_t)7; // keep them aligned
+        if (batch.count == IPC_BATCH_MAX || batch.used + size > batch.size) {
+            if (stream_flush(client, ring, &batch) == -1) {
+                retval = -1;
+                break;
+            }
+        }
+
+        if (rate && pace(client, ring, &batch, &start, rate, n) == -1) {
+            retval = -1;
+            break;
+        }
+
+        char *msg = batch.buf + batch.used;
+        batch.entries[batch.count].data = (uintptr_t)msg;
+        batch.entries[batch.count].len = ipc_message_build(msg, batch.size - batch.used, pid, time(NULL), text, len);
+        batch.entries[batch.count].status = 0;
+        batch.count++;
+        batch.used += size;
+        n++;
+    }
+
+    if (retval == 0 && stream_flush(client, ring, &batch) == -1) {
+        retval = -1;
+    }
+
+    double seconds = elapsed(&start);
+    printf("Wrote %llu messages (%llu failed) in %.3f s, %.0f messages/s\n",
+           batch.written, batch.failed, seconds, seconds > 0 ? batch.written / seconds : 0.0);
+
+out:
+    free(batch.buf);
+    free(in.buf);
+    if (in.fd != 0) {
+        close(in.fd);
+    }
+    return retval;
 }
 
 //Take messages from console
 //argc is no. of arguments and argv is an array of string for the arguments
+// Options come first, in any order:
+//   -d /dev/ipc_deviceN   writes to another channel
+//   -k <cipher>           changes how the driver encrypts messages first, see set_key()
+//   -c lz4|none           turns the driver's compression on or off first
+//   -m                    pushes messages straight into the mmap'd ring instead of write()
+//   -i <file>             streams messages from the file ("-" for stdin) instead of taking one
+//   -z                    with -i, each message is a 32-bit length then the bytes, not a line
+//   -r 10000              with -i, writes at most that many messages per second
+//   -U                    uses the shared memory ring even if the module is loaded, see ipc_client.h
 int main(int argc, char *argv[]) {
-    if (argc < 2) { //means message was not provided
+    const char *program = argv[0];
+    enum ipc_backend backend = IPC_BACKEND_AUTO;
+    int use_mmap = 0;
+    int length_delimited = 0;
+    long rate = 0;
+    const char *key_spec = NULL;
+    const char *compress_spec = NULL;
+    const char *device = IPC_DEFAULT_DEVICE;
+    const char *input_path = NULL;
+
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-m") == 0) {
+            use_mmap = 1;
+            argv++;
+            argc--;
+            continue;
+        }
+        if (strcmp(argv[1], "-z") == 0) {
+            length_delimited = 1;
+            argv++;
+            argc--;
+            continue;
+        }
+        if (strcmp(argv[1], "-U") == 0) {
+            backend = IPC_BACKEND_SHM;
+            argv++;
+            argc--;
+            continue;
+        }
+
+        if (argc > 2 && strcmp(argv[1], "-d") == 0) {
+            device = argv[2];
+        } else if (argc > 2 && strcmp(argv[1], "-k") == 0) {
+            key_spec = argv[2];
+        } else if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+            compress_spec = argv[2];
+        } else if (argc > 2 && strcmp(argv[1], "-i") == 0) {
+            input_path = argv[2];
+        } else if (argc > 2 && strcmp(argv[1], "-r") == 0) {
+            rate = atol(argv[2]);
+        } else {
+            break; // not an option, must be a message that starts with -
+        }
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (!input_path && argc < 2) { //means message was not provided
         printf("ERROR: No message provided.\n"); 
-        printf("Expected format: %s \"your message\" \n", argv[0]); 
+        printf("Expected format: %s [-d device] [-k cipher[:hexkey]] [-c lz4|none] [-m] \"your message\" \n", program); 
+        printf("             or: %s [-d device] [-k cipher[:hexkey]] [-c lz4|none] [-m] [-U] -i file|- [-z] [-r per second]\n", program);
         return 1;
     }
 
-    if (argc > 2) {
+    if (argc > (input_path ? 1 : 2) || rate < 0) {
         printf("ERROR: Too many arguments provided.\n"); 
-        printf("Expected format: %s \"your message\" \n", argv[0]); 
+        printf("Expected format: %s [-d device] [-k cipher[:hexkey]] [-c lz4|none] [-m] \"your message\" \n", program); 
+        printf("             or: %s [-d device] [-k cipher[:hexkey]] [-c lz4|none] [-m] [-U] -i file|- [-z] [-r per second]\n", program);
         return 1;
     }
 
-    // Open device for writing
-    // O_WRONLY == write only
-    int fd = open(DEVICE_PATH, O_WRONLY); // file descriptor that stores what open() returns
-    if (fd == -1) { 
+    // Open device for writing (or the shared memory ring if the module isn't loaded)
+    struct ipc_client *client = ipc_open(device, IPC_WRITE, backend);
+    if (!client) { 
         perror("Failed to open device"); 
         return 1;
     }
+    int fd = ipc_fd(client); // -1 for shared memory
 
     // Testing ioctl shtuff
-    int shm_size;
-    if (ioctl(fd, IOCTL_GET_SHM_SIZE, &shm_size) == -1) {
+    int shm_size = ipc_ring_size(client);
+    if (shm_size < 0) {
+        errno = -shm_size;
         perror("Failed to get shared memory size");
-        close(fd);
+        ipc_close(client);
         return -1;
     }
     printf("Shared Memory Size: %d\n", shm_size);
 
+    if (key_spec && set_key(fd, key_spec) == -1) {
+        ipc_close(client);
+        return -1;
+    }
+
+    if (compress_spec && set_compress(fd, compress_spec) == -1) {
+        ipc_close(client);
+        return -1;
+    }
+
+    // Map the ring once, to copy messages in ourselves, no write() involved
+    // (shared memory has no write() to skip, -m is the device's)
+    struct ipc_ring_ctrl *ring = NULL;
+    size_t map_size = ipc_ring_map_size(shm_size);
+    if (use_mmap && fd != -1) {
+        // A writable mapping needs a read-write open. It never reads, so the
+        // driver doesn't give it a cursor that would hold the ring up.
+        int map_fd = open(device, O_RDWR);
+        ring = map_fd == -1 ? MAP_FAILED : mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, map_fd, 0);
+        if (map_fd != -1) {
+            close(map_fd); // the mapping keeps the file open
+        }
+        if (ring == MAP_FAILED) {
+            perror("Failed to map the ring");
+            ipc_close(client);
+            return -1;
+        }
+    }
+
+    if (input_path) {
+        int ret = stream_messages(client, ring, shm_size, input_path, length_delimited, rate);
+        if (ring) {
+            munmap(ring, map_size);
+        }
+        ipc_close(client);
+        return ret == -1 ? 1 : 0;
+    }
+
     /* https://www.quora.com/How-does-the-write-function-work-in-C-Can-you-explain-this-function */
 
     size_t message_length = strlen(argv[1]); //Length of the message string
-    size_t total_message_size = sizeof(struct message_data) + message_length; //Size of the message struct with metadata
+    size_t total_message_size = IPC_MESSAGE_SIZE(message_length); //Size of the message struct with metadata
 
     struct message_data *new_msg = malloc(total_message_size);
     if (!new_msg) {
         perror("Failed to allocate memory for message");
-        close(fd);
-        return -1;
-    }
-
-    // Set la data in the struct (`->` automatically dereferences the pointer)
-    new_msg->writer_pid = getpid(); // Process ID of the writer
-    new_msg->timestamp = time(NULL); // When the message was created
-    new_msg->message_length = message_length; // Length of the actual message's content
-    // Just copies the message passed in as the argument to the memory location
-    // opf the message in the struct
-    memcpy(new_msg->message, argv[1], message_length);
-
-    char timestamp_string[256]; 
-    char pid_string[256]; 
-    sprintf(timestamp_string, "%ld", new_msg->timestamp); // Converts timestamp to string
-    sprintf(pid_string, "%ld", new_msg->writer_pid); // Converts PID to string
-
-    char *to_be_hashed = malloc(strlen(timestamp_string) + strlen(pid_string) + message_length + 1); // +1 for null terminator
-    if (!to_be_hashed) {
-        perror("Failed to allocate memory for hash string");
-        close(fd);
+        ipc_close(client);
         return -1;
     }
 
-    to_be_hashed[0] = '\0'; //empty string
-    to_be_hashed = strcat(to_be_hashed, timestamp_string);
-    to_be_hashed = strcat(to_be_hashed, pid_string);
-    to_be_hashed = strcat(to_be_hashed, new_msg->message);
+    // Set la data in the struct, and hash it
+    ipc_message_build(new_msg, total_message_size, getpid(), time(NULL), argv[1], message_length);
 
-    // Absolutely cooked way of hashing it but sure
-    new_msg->unique_hash = hash(to_be_hashed); // Used for identifying unique messages
+    ssize_t bytes_written;
 
-    free(to_be_hashed);
+    if (ring) {
+        int err = ipc_ring_push(ring, new_msg, total_message_size);
+        if (err < 0) {
+            errno = -err;
+            bytes_written = -1;
+        } else {
+            bytes_written = total_message_size;
+            ioctl(fd, IOCTL_RING_NOTIFY); // wake readers blocked in read()/poll()
+        }
 
-    // Write messages to device 
-    ssize_t bytes_written = write(fd, new_msg, total_message_size); //writes the message  to device
+        munmap(ring, map_size);
+    } else {
+        // Write messages to device 
+        bytes_written = ipc_send(client, new_msg, total_message_size); //writes the message  to device
+        if (bytes_written < 0) {
+            errno = -bytes_written;
+        }
+    }
 
     free(new_msg);
 
@@ -116,6 +562,6 @@ int main(int argc, char *argv[]) {
         printf("Data written to device successfully.");
     }
 
-    close(fd); 
+    ipc_close(client); 
     return 0;
 }